@@ -1,33 +1,141 @@
 #ifndef _GRAMTROPY_BIGNUM_H_
 #define _GRAMTROPY_BIGNUM_H_
 
+#include <assert.h>
 #include <math.h>
+#include <string.h>
 #include <string>
-#include <vector>
+#include <algorithm>
 #include <stdint.h>
 
+/* Vector of 32-bit limbs that keeps up to INLINE_LIMBS entries (512 bits)
+ * inside the object itself, and only uses the heap for larger numbers. */
+class LimbVector {
+    static const unsigned int INLINE_LIMBS = 16;
+
+    uint32_t* ptr;
+    unsigned int len;
+    unsigned int cap;
+    uint32_t storage[INLINE_LIMBS];
+
+    bool is_inline() const {
+        return ptr == storage;
+    }
+
+    void grow(unsigned int n) {
+        unsigned int ncap = std::max(n, cap * 2);
+        uint32_t* nptr = new uint32_t[ncap];
+        memcpy(nptr, ptr, len * sizeof(uint32_t));
+        if (!is_inline()) delete[] ptr;
+        ptr = nptr;
+        cap = ncap;
+    }
+
+public:
+    LimbVector() : ptr(storage), len(0), cap(INLINE_LIMBS) {}
+    LimbVector(const LimbVector& x) : ptr(storage), len(0), cap(INLINE_LIMBS) { *this = x; }
+    LimbVector(LimbVector&& x) : ptr(storage), len(0), cap(INLINE_LIMBS) { *this = std::move(x); }
+    ~LimbVector() {
+        if (!is_inline()) delete[] ptr;
+    }
+
+    LimbVector& operator=(const LimbVector& x) {
+        if (&x != this) {
+            len = 0;
+            reserve(x.len);
+            memcpy(ptr, x.ptr, x.len * sizeof(uint32_t));
+            len = x.len;
+        }
+        return *this;
+    }
+
+    LimbVector& operator=(LimbVector&& x) {
+        if (&x == this) {
+            return *this;
+        }
+        if (x.is_inline()) {
+            *this = x;
+        } else {
+            if (!is_inline()) delete[] ptr;
+            ptr = x.ptr;
+            len = x.len;
+            cap = x.cap;
+            x.ptr = x.storage;
+            x.cap = INLINE_LIMBS;
+        }
+        x.len = 0;
+        return *this;
+    }
+
+    void reserve(unsigned int n) {
+        if (n > cap) grow(n);
+    }
+
+    void resize(unsigned int n) {
+        reserve(n);
+        if (n > len) memset(ptr + len, 0, (n - len) * sizeof(uint32_t));
+        len = n;
+    }
+
+    void assign(unsigned int n, uint32_t val) {
+        len = 0;
+        reserve(n);
+        std::fill(ptr, ptr + n, val);
+        len = n;
+    }
+
+    void push_back(uint32_t val) {
+        reserve(len + 1);
+        ptr[len++] = val;
+    }
+
+    void pop_back() { --len; }
+    unsigned int size() const { return len; }
+    bool empty() const { return len == 0; }
+    uint32_t& back() { return ptr[len - 1]; }
+    uint32_t back() const { return ptr[len - 1]; }
+    const uint32_t* data() const { return ptr; }
+    uint32_t& operator[](unsigned int pos) { return ptr[pos]; }
+    uint32_t operator[](unsigned int pos) const { return ptr[pos]; }
+};
+
+/* A number stored elsewhere, as len little-endian limbs without leading zero limbs. */
+struct LimbRef {
+    const uint32_t* limbs;
+    unsigned int len;
+};
+
+/* The precomputed data of a Divisor (see below), stored elsewhere. */
+struct DivisorRef {
+    LimbRef value;
+    const uint32_t* norm;
+    int shift;
+    uint32_t inv;
+};
+
+class Divisor;
+
 class BigNum {
-    std::vector<uint32_t> pn;
+    friend class Divisor;
+
+    LimbVector pn;
 
     void shrink() {
         while (!pn.empty() && pn.back() == 0) pn.pop_back();
     }
 
     void shift_right_one() {
-        std::vector<uint32_t> r;
-        r.resize(pn.size());
         for (unsigned int i = 0; i < pn.size(); i++) {
-            if (i >= 1) {
-                r[i - 1] |= (pn[i] << 31);
+            pn[i] >>= 1;
+            if (i + 1 < pn.size()) {
+                pn[i] |= (pn[i + 1] << 31);
             }
-            r[i] |= (pn[i] >> 1);
         }
-        pn = std::move(r);
         shrink();
     }
 
     void shift_left(int shift) {
-        std::vector<uint32_t> r;
+        LimbVector r;
         r.resize(pn.size() + (shift + 31) / 32);
         int k = shift / 32;
         shift %= 32;
@@ -41,89 +149,158 @@ class BigNum {
         shrink();
     }
 
-    int compare(const BigNum& b) const {
-        unsigned int s = pn.size();
-        if (s < b.pn.size()) return -1;
-        if (s > b.pn.size()) return 1;
-        for (unsigned int i = 0; i < s; i++) {
-            if (pn[s - 1 - i] < b.pn[s - 1 - i]) return -1;
-            if (pn[s - 1 - i] > b.pn[s - 1 - i]) return 1;
-        }
-        return 0;
-    }
-
-public:
-    BigNum() {}
-
-    BigNum(uint32_t n) {
-        if (n > 0) {
-            pn.resize(1);
-            pn[0] = n;
+    /* Shift the limbs of d left so the top bit is set, and return the shift. d must not be
+     * zero. */
+    static int normalize(const LimbVector& d, LimbVector& out) {
+        assert(!d.empty());
+        unsigned int n = d.size();
+        int s = 0;
+        while (!((d[n - 1] << s) & 0x80000000)) s++;
+        out.resize(n);
+        for (unsigned int i = n - 1; i > 0; i--) {
+            out[i] = (d[i] << s) | (uint32_t)((uint64_t)d[i - 1] >> (32 - s));
         }
+        out[0] = d[0] << s;
+        return s;
     }
 
-    BigNum(uint8_t* data, size_t len) {
-        pn.assign((len + 3) / 4, 0);
-        for (unsigned i = 0; i < len; i++) {
-            pn[i / 4] |= ((uint32_t)data[len - 1 - i]) << (8 * i);
-        }
-        shrink();
-    }
+    template<bool PREINV>
+    BigNum divmod_normalized(const uint32_t* v, unsigned int n, int s, uint32_t inv);
 
-    BigNum& operator+=(const BigNum& b) {
-        pn.resize(std::max(pn.size(), b.pn.size()) + 1);
+    void add(const uint32_t* b, unsigned int bn) {
+        pn.resize(std::max(pn.size(), bn) + 1);
         uint64_t carry = 0;
-        for (unsigned int i = 0; i < b.pn.size(); i++) {
-            carry += (uint64_t)pn[i] + b.pn[i];
+        for (unsigned int i = 0; i < bn; i++) {
+            carry += (uint64_t)pn[i] + b[i];
             pn[i] = carry;
             carry >>= 32;
         }
-        for (unsigned int i = b.pn.size(); i < pn.size(); i++) {
+        for (unsigned int i = bn; i < pn.size(); i++) {
             carry += pn[i];
             pn[i] = carry;
             carry >>= 32;
         }
         shrink();
-        return *this;
     }
 
-    BigNum& operator-=(const BigNum& b) {
+    void sub(const uint32_t* b, unsigned int bn) {
         uint64_t carry = 1;
-        for (unsigned int i = 0; i < b.pn.size(); i++) {
-            carry += (uint64_t)pn[i] + ~b.pn[i];
+        for (unsigned int i = 0; i < bn; i++) {
+            carry += (uint64_t)pn[i] + ~b[i];
             pn[i] = carry;
             carry >>= 32;
         }
-        for (unsigned int i = b.pn.size(); i < pn.size(); i++) {
+        for (unsigned int i = bn; i < pn.size(); i++) {
             carry += (uint64_t)pn[i] + 0xFFFFFFFFUL;
             pn[i] = carry;
             carry >>= 32;
         }
         shrink();
-        return *this;
     }
 
-    friend BigNum operator*(const BigNum& a, const BigNum& b) {
+    static BigNum mul(const uint32_t* a, unsigned int an, const uint32_t* b, unsigned int bn) {
         BigNum r;
-        r.pn.resize(a.pn.size() + b.pn.size());
-        for (unsigned int j = 0; j < a.pn.size(); j++) {
+        r.pn.resize(an + bn);
+        for (unsigned int j = 0; j < an; j++) {
             uint64_t carry = 0;
-            for (unsigned int i = 0; i < b.pn.size(); i++) {
-                carry += r.pn[i + j] + (uint64_t)a.pn[j] * b.pn[i];
+            for (unsigned int i = 0; i < bn; i++) {
+                carry += r.pn[i + j] + (uint64_t)a[j] * b[i];
                 r.pn[i + j] = carry;
                 carry >>= 32;
             }
-            r.pn[b.pn.size() + j] += carry;
+            r.pn[bn + j] += carry;
         }
         r.shrink();
         return r;
     }
 
+    int compare(const uint32_t* b, unsigned int bn) const {
+        unsigned int s = pn.size();
+        if (s < bn) return -1;
+        if (s > bn) return 1;
+        for (unsigned int i = 0; i < s; i++) {
+            if (pn[s - 1 - i] < b[s - 1 - i]) return -1;
+            if (pn[s - 1 - i] > b[s - 1 - i]) return 1;
+        }
+        return 0;
+    }
+
+    int compare(const BigNum& b) const {
+        return compare(b.pn.data(), b.pn.size());
+    }
+
+public:
+    BigNum() {}
+
+    BigNum(uint32_t n) {
+        if (n > 0) {
+            pn.resize(1);
+            pn[0] = n;
+        }
+    }
+
+    /* Construct from len little-endian 32-bit limbs. */
+    BigNum(const uint32_t* limbs, size_t len) {
+        pn.resize(len);
+        for (size_t i = 0; i < len; i++) {
+            pn[i] = limbs[i];
+        }
+        shrink();
+    }
+
+    BigNum(uint8_t* data, size_t len) {
+        pn.assign((len + 3) / 4, 0);
+        for (unsigned i = 0; i < len; i++) {
+            pn[i / 4] |= ((uint32_t)data[len - 1 - i]) << (8 * i);
+        }
+        shrink();
+    }
+
+    BigNum& operator+=(const BigNum& b) {
+        if (&b == this) {
+            // add() may reallocate the limbs it reads from.
+            BigNum c = b;
+            add(c.pn.data(), c.pn.size());
+            return *this;
+        }
+        add(b.pn.data(), b.pn.size());
+        return *this;
+    }
+
+    BigNum& operator+=(const LimbRef& b) {
+        add(b.limbs, b.len);
+        return *this;
+    }
+
+    BigNum& operator-=(const BigNum& b) {
+        sub(b.pn.data(), b.pn.size());
+        return *this;
+    }
+
+    BigNum& operator-=(const LimbRef& b) {
+        sub(b.limbs, b.len);
+        return *this;
+    }
+
+    friend BigNum operator*(const BigNum& a, const BigNum& b) {
+        return mul(a.pn.data(), a.pn.size(), b.pn.data(), b.pn.size());
+    }
+
     BigNum& operator*=(const BigNum& b) {
-        *this = *this * b;
+        *this = mul(pn.data(), pn.size(), b.pn.data(), b.pn.size());
+        return *this;
+    }
+
+    BigNum& operator*=(const LimbRef& b) {
+        *this = mul(pn.data(), pn.size(), b.limbs, b.len);
         return *this;
     }
 
+    /* Compare with a number stored elsewhere: negative, zero or positive. */
+    int compare(const LimbRef& b) const {
+        return compare(b.limbs, b.len);
+    }
+
     int bits() const {
         if (pn.size() == 0) return 0;
         int ret = pn.size() * 32;
@@ -142,8 +319,15 @@ public:
     friend bool operator==(const BigNum& a, const BigNum& b) { return a.compare(b) == 0; }
     friend bool operator!=(const BigNum& a, const BigNum& b) { return a.compare(b) != 0; }
 
-    /* Return *this / denom and replace *this with *this % denom. */
-    BigNum divmod(const BigNum& denom) {
+    /* Return *this / denom and replace *this with *this % denom. denom must not be zero. */
+    BigNum divmod(const BigNum& denom);
+
+    /* Same, with a divisor whose normalization and reciprocal are precomputed. */
+    BigNum divmod(const Divisor& denom);
+    BigNum divmod(const DivisorRef& denom);
+
+    /* Bit-by-bit shift-and-subtract version of divmod, kept as a reference for benchmarks. */
+    BigNum divmod_bitwise(const BigNum& denom) {
         int numbits = bits();
         int divbits = denom.bits();
         if (divbits > numbits) {
@@ -166,33 +350,41 @@ public:
         return r;
     }
 
-    std::string hex() const {
+    /* Append the hexadecimal representation to out. */
+    void hex(std::string& out) const {
         if (is_zero()) {
-            return "0";
+            out += '0';
+            return;
         }
         static const char cv[16] = {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'};
         unsigned int digits = (bits() + 3) / 4;
-        std::string ret;
+        size_t pos = out.size() + digits;
+        out.resize(pos);
         for (unsigned int i = 0; i < digits; i++) {
-            ret = cv[(pn[i / 8] >> (4 * (i % 8))) % 16] + ret;
+            out[--pos] = cv[(pn[i / 8] >> (4 * (i % 8))) % 16];
         }
+    }
+
+    std::string hex() const {
+        std::string ret;
+        hex(ret);
         return ret;
     }
 
-    bool set_hex(const std::string& str) {
+    bool set_hex(const char* str, size_t len) {
         static const int cv[128] = {
             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
             0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
-            0, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-            0, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
         };
-        pn.assign((str.size() * 4 + 28) >> 5, 0);
-        for (size_t pos = 0; pos < str.size(); pos++) {
-            unsigned char c = *(str.end() - 1 - pos);
+        pn.assign((len * 4 + 28) >> 5, 0);
+        for (size_t pos = 0; pos < len; pos++) {
+            unsigned char c = str[len - 1 - pos];
             if (c > 127 || cv[c] == -1) {
                 return false;
             } else {
@@ -203,6 +395,10 @@ public:
         return true;
     }
 
+    bool set_hex(const std::string& str) {
+        return set_hex(str.data(), str.size());
+    }
+
     double log2() const {
         double ret = 0;
         unsigned int i = 0;
@@ -220,6 +416,14 @@ public:
         return ret;
     }
 
+    unsigned int limbs() const {
+        return pn.size();
+    }
+
+    uint32_t limb(unsigned int pos) const {
+        return pn[pos];
+    }
+
     uint32_t get_ui() const {
         if (pn.empty()) return 0;
         return pn[0];
@@ -239,4 +443,165 @@ public:
     }
 };
 
+/* A divisor with precomputed normalization data: its limbs shifted so the top bit is set,
+ * and a reciprocal of the top limb. Dividing by it then uses multiplications to estimate
+ * each quotient limb, instead of a hardware division (Moller and Granlund, "Improved
+ * division by invariant integers", 2011). */
+class Divisor {
+    friend class BigNum;
+
+    BigNum value;
+    LimbVector norm;
+    int shift;
+    uint32_t inv;
+
+public:
+    Divisor() : shift(0), inv(0) {}
+
+    /* A zero val gives an empty divisor, which divmod must not be called with. */
+    explicit Divisor(const BigNum& val) : value(val), shift(0), inv(0) {
+        if (value.is_zero()) {
+            return;
+        }
+        shift = BigNum::normalize(value.pn, norm);
+        uint32_t d = norm.back();
+        inv = ((((uint64_t)~d) << 32) | 0xFFFFFFFF) / d;
+    }
+
+    const BigNum& get() const {
+        return value;
+    }
+
+    DivisorRef ref() const {
+        DivisorRef ret = {{value.pn.data(), value.pn.size()}, norm.data(), shift, inv};
+        return ret;
+    }
+
+    /* Divide (u1:u0) by the normalized d, given u1 < d. With PREINV, inv must be
+     * floor((2^64 - 1) / d) - 2^32, and the division is done by multiplication. */
+    template<bool PREINV>
+    static uint32_t div2by1(uint32_t u1, uint32_t u0, uint32_t d, uint32_t inv, uint32_t& r) {
+        if (!PREINV) {
+            uint64_t num = ((uint64_t)u1 << 32) | u0;
+            r = num % d;
+            return num / d;
+        }
+        uint64_t q = (uint64_t)inv * u1 + (((uint64_t)u1 << 32) | u0);
+        uint32_t q1 = (q >> 32) + 1;
+        uint32_t q0 = q;
+        r = u0 - q1 * d;
+        if (r > q0) {
+            q1--;
+            r += d;
+        }
+        if (r >= d) {
+            q1++;
+            r -= d;
+        }
+        return q1;
+    }
+};
+
+/* Knuth's algorithm D (TAOCP vol. 2, 4.3.1), dividing by the normalized limbs v
+ * (the actual divisor shifted left by s). *this must not be less than the divisor. */
+template<bool PREINV>
+inline BigNum BigNum::divmod_normalized(const uint32_t* v, unsigned int n, int s, uint32_t inv) {
+    unsigned int m = pn.size() - n;
+    BigNum q;
+    q.pn.resize(m + 1);
+
+    if (n == 1) {
+        // Single-limb divisor: one 2-by-1 step per limb, normalizing the numerator on the fly.
+        uint32_t r = (uint64_t)pn[m] >> (32 - s);
+        for (unsigned int j = m; j > 0; j--) {
+            uint32_t u0 = (pn[j] << s) | (uint32_t)((uint64_t)pn[j - 1] >> (32 - s));
+            q.pn[j] = Divisor::div2by1<PREINV>(r, u0, v[0], inv, r);
+        }
+        q.pn[0] = Divisor::div2by1<PREINV>(r, pn[0] << s, v[0], inv, r);
+        pn.assign(1, r >> s);
+        shrink();
+        q.shrink();
+        return q;
+    }
+
+    LimbVector u;
+    u.resize(pn.size() + 1);
+    u[pn.size()] = (uint64_t)pn[pn.size() - 1] >> (32 - s);
+    for (unsigned int i = pn.size() - 1; i > 0; i--) {
+        u[i] = (pn[i] << s) | (uint32_t)((uint64_t)pn[i - 1] >> (32 - s));
+    }
+    u[0] = pn[0] << s;
+
+    for (unsigned int j = m + 1; j-- > 0;) {
+        // Estimate the quotient limb from the top two limbs; it is off by at most 2.
+        uint64_t qhat, rhat;
+        if (u[j + n] == v[n - 1]) {
+            qhat = 0xFFFFFFFF;
+            rhat = (uint64_t)u[j + n - 1] + v[n - 1];
+        } else {
+            uint32_t r;
+            qhat = Divisor::div2by1<PREINV>(u[j + n], u[j + n - 1], v[n - 1], inv, r);
+            rhat = r;
+        }
+        while (!(rhat >> 32) && qhat * v[n - 2] > ((rhat << 32) | u[j + n - 2])) {
+            qhat--;
+            rhat += v[n - 1];
+        }
+        // Multiply and subtract qhat * v from u[j..j+n].
+        int64_t borrow = 0;
+        int64_t t;
+        for (unsigned int i = 0; i < n; i++) {
+            uint64_t p = qhat * v[i];
+            t = (int64_t)u[i + j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+            u[i + j] = t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)u[j + n] - borrow;
+        u[j + n] = t;
+        if (t < 0) {
+            // Estimate was one too large; add v back.
+            qhat--;
+            uint64_t carry = 0;
+            for (unsigned int i = 0; i < n; i++) {
+                carry += (uint64_t)u[i + j] + v[i];
+                u[i + j] = carry;
+                carry >>= 32;
+            }
+            u[j + n] += carry;
+        }
+        q.pn[j] = qhat;
+    }
+
+    // Unnormalize the remainder.
+    pn.resize(n);
+    for (unsigned int i = 0; i < n; i++) {
+        pn[i] = (u[i] >> s) | (uint32_t)((uint64_t)u[i + 1] << (32 - s));
+    }
+    shrink();
+    q.shrink();
+    return q;
+}
+
+inline BigNum BigNum::divmod(const BigNum& denom) {
+    assert(!denom.is_zero());
+    if (compare(denom) < 0) {
+        return BigNum();
+    }
+    LimbVector v;
+    int s = normalize(denom.pn, v);
+    return divmod_normalized<false>(&v[0], v.size(), s, 0);
+}
+
+inline BigNum BigNum::divmod(const DivisorRef& denom) {
+    assert(denom.value.len > 0);
+    if (compare(denom.value) < 0) {
+        return BigNum();
+    }
+    return divmod_normalized<true>(denom.norm, denom.value.len, denom.shift, denom.inv);
+}
+
+inline BigNum BigNum::divmod(const Divisor& denom) {
+    return divmod(denom.ref());
+}
+
 #endif
@@ -0,0 +1,511 @@
+#include "codegen.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+/* Bytes of dictionary data per line of a string literal. */
+static const size_t LITERAL_LINE = 32;
+
+void Append(std::string& out, const char* fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf)) {
+        std::vector<char> big(len + 1);
+        va_start(ap, fmt);
+        vsnprintf(big.data(), big.size(), fmt, ap);
+        va_end(ap);
+        out.append(big.data(), len);
+    } else if (len > 0) {
+        out.append(buf, len);
+    }
+}
+
+uint64_t Get64(const LimbRef& ref) {
+    uint64_t ret = 0;
+    for (unsigned int i = ref.len; i > 0; i--) {
+        ret = (ret << 32) | ref.limbs[i - 1];
+    }
+    return ret;
+}
+
+std::string Const(uint64_t num) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), num >> 32 ? "%" PRIu64 "ull" : "%" PRIu64 "u", num);
+    return buf;
+}
+
+std::string Limbs(const uint32_t* limbs, unsigned int len) {
+    std::string ret = "{";
+    for (unsigned int i = 0; i < len; i++) {
+        Append(ret, i ? ", 0x%" PRIx32 : "0x%" PRIx32, limbs[i]);
+    }
+    return ret + "}";
+}
+
+/* Emits the source for one graph. Nodes are named after their index in the graph; numbers below
+ * the count of a node whose count fits in 64 bits ("narrow" nodes) are passed as uint64_t, others
+ * as BigNum. */
+class SourceWriter {
+    const FlatGraph& graph;
+    std::string out;
+    std::vector<bool> reachable;
+    std::vector<bool> divisors; // Nodes that a wide CONCAT needs as a DivisorRef.
+    // Byte sets are shared between nodes; these are the indices of the first and last byte sets
+    // of each node.
+    std::map<std::array<uint64_t, 4>, size_t> sets;
+    std::vector<size_t> firstsets;
+    std::vector<size_t> lastsets;
+
+    /* Index of the set_ array for set, emitting it if it is new. */
+    size_t SetIndex(const CharSet& set) {
+        std::array<uint64_t, 4> key = {{set.bits[0], set.bits[1], set.bits[2], set.bits[3]}};
+        auto ins = sets.emplace(key, sets.size());
+        if (ins.second) {
+            Append(out, "static constexpr uint64_t set_%lu[4] = {0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 "};\n", (unsigned long)ins.first->second, key[0], key[1], key[2], key[3]);
+        }
+        return ins.first->second;
+    }
+
+    bool Narrow(uint32_t node) const {
+        return graph.CountRef(node).len <= 2;
+    }
+
+    bool Fixed(uint32_t node) const {
+        return graph.lens[node] >= 0;
+    }
+
+    uint32_t First(uint32_t node) const {
+        return graph.firsts[node];
+    }
+
+    uint32_t End(uint32_t node) const {
+        return graph.types[node] == FlatGraph::NodeType::DICT ? graph.firsts[node] : graph.firsts[node] + graph.nums[node];
+    }
+
+    const char* Type(uint32_t node) const {
+        return Narrow(node) ? "uint64_t" : "BigNum";
+    }
+
+    /* Pass var, a number of a node of type parent_narrow, to node. */
+    std::string Arg(uint32_t node, bool parent_narrow, const std::string& var) const {
+        if (parent_narrow) {
+            return var;
+        }
+        return Narrow(node) ? "Low64(" + var + ")" : "std::move(" + var + ")";
+    }
+
+    /* Convert var, a number of node, to a BigNum. */
+    std::string Widen(uint32_t node, const std::string& var) const {
+        return Narrow(node) ? "Wide(" + var + ")" : "std::move(" + var + ")";
+    }
+
+    std::string ParseCall(uint32_t node, const std::string& str, const std::string& len, const std::string& var) const {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "parse_%lu(", (unsigned long)node);
+        return buf + str + (Fixed(node) ? "" : ", " + len) + ", " + var + ")";
+    }
+
+    /* The checks for str of length len before parsing node there, empty if there are none. With
+     * a fixed length, len is known to be right already. */
+    std::string EntryChecks(uint32_t node, const std::string& str, const std::string& len, bool fixed_len) const {
+        std::string ret;
+        auto add = [&](const std::string& cond) {
+            ret += ret.empty() ? cond : " && " + cond;
+        };
+        unsigned long first = firstsets[node], last = lastsets[node];
+        if (Fixed(node)) {
+            long nodelen = graph.lens[node];
+            if (!fixed_len) {
+                add(len + " == " + std::to_string(nodelen));
+            }
+            if (nodelen > 0) {
+                char buf[128];
+                snprintf(buf, sizeof(buf), "Has(set_%lu, %s[0]) && Has(set_%lu, %s[%ld])", first, str.c_str(), last, str.c_str(), nodelen - 1);
+                add(buf);
+            }
+        } else {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s <= %lu && (%s == 0 || (Has(set_%lu, %s[0]) && Has(set_%lu, %s[%s - 1])))", len.c_str(), (unsigned long)graph.maxlens[node], len.c_str(), first, str.c_str(), last, str.c_str(), len.c_str());
+            add(buf);
+        }
+        return ret;
+    }
+
+    void Mark();
+    void WriteHelpers();
+    void WriteData(uint32_t node);
+    void WriteGenerate(uint32_t node);
+    void WriteSelect(uint32_t node, uint32_t lo, uint32_t hi, const std::string& indent);
+    void WriteParse(uint32_t node);
+    void WriteEntry();
+    void WriteApi();
+
+public:
+    explicit SourceWriter(const FlatGraph& graph_) : graph(graph_) {}
+
+    std::string Write(const char* name);
+};
+
+void SourceWriter::Mark() {
+    reachable.assign(graph.size(), false);
+    divisors.assign(graph.size(), false);
+    firstsets.assign(graph.size(), 0);
+    lastsets.assign(graph.size(), 0);
+    reachable[graph.root()] = true;
+    for (uint32_t node = graph.size(); node > 0; node--) {
+        if (!reachable[node - 1]) {
+            continue;
+        }
+        for (uint32_t ref = First(node - 1); ref < End(node - 1); ref++) {
+            reachable[graph.refnodes[ref]] = true;
+            if (graph.types[node - 1] == FlatGraph::NodeType::CONCAT && !Narrow(node - 1)) {
+                divisors[graph.refnodes[ref]] = true;
+            }
+        }
+    }
+}
+
+void SourceWriter::WriteHelpers() {
+    out += "static inline uint64_t Low64(const BigNum& num) {\n";
+    out += "    uint64_t ret = num.limbs() > 1 ? (uint64_t)num.limb(1) << 32 : 0;\n";
+    out += "    return ret | num.get_ui();\n";
+    out += "}\n\n";
+    out += "static inline BigNum Wide(uint64_t num) {\n";
+    out += "    uint32_t limbs[2] = {(uint32_t)num, (uint32_t)(num >> 32)};\n";
+    out += "    return BigNum(limbs, 2);\n";
+    out += "}\n\n";
+    out += "static inline bool Has(const uint64_t* set, unsigned char c) {\n";
+    out += "    return (set[c >> 6] >> (c & 63)) & 1;\n";
+    out += "}\n\n";
+    out += "/* Binary search for str in the count sorted strings of length len in dict. */\n";
+    out += "static inline bool Find(const char* dict, size_t len, size_t count, const char* str, uint64_t& out) {\n";
+    out += "    size_t lo = 0, hi = count;\n";
+    out += "    while (lo < hi) {\n";
+    out += "        size_t mid = (lo + hi) / 2;\n";
+    out += "        int cmp = memcmp(str, dict + mid * len, len);\n";
+    out += "        if (cmp == 0) {\n";
+    out += "            out = mid;\n";
+    out += "            return true;\n";
+    out += "        }\n";
+    out += "        if (cmp < 0) {\n";
+    out += "            hi = mid;\n";
+    out += "        } else {\n";
+    out += "            lo = mid + 1;\n";
+    out += "        }\n";
+    out += "    }\n";
+    out += "    return false;\n";
+    out += "}\n\n";
+}
+
+void SourceWriter::WriteData(uint32_t node) {
+    unsigned long n = node;
+    if (graph.types[node] == FlatGraph::NodeType::DICT) {
+        const Strings& dict = graph.dicts[First(node)];
+        const char* data = dict.StringBegin(0);
+        size_t size = dict.size() * dict.length();
+        Append(out, "static constexpr char dict_%lu[] =", n);
+        if (size == 0) {
+            out += " \"\"";
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (i % LITERAL_LINE == 0) {
+                out += i ? "\"\n    \"" : "\n    \"";
+            }
+            unsigned char c = data[i];
+            // Octal escapes are at most 3 digits, so they cannot swallow the next character.
+            if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\' && c != '?') {
+                out += (char)c;
+            } else {
+                Append(out, "\\%03o", c);
+            }
+        }
+        out += size ? "\";\n" : ";\n";
+    }
+    if (divisors[node]) {
+        DivisorRef div = graph.GetDivisor(node);
+        Append(out, "static constexpr uint32_t count_%lu[] = %s;\n", n, Limbs(div.value.limbs, div.value.len).c_str());
+        Append(out, "static constexpr uint32_t norm_%lu[] = %s;\n", n, Limbs(div.norm, div.value.len).c_str());
+        Append(out, "static constexpr DivisorRef div_%lu = {{count_%lu, %u}, norm_%lu, %d, 0x%" PRIx32 "};\n", n, n, div.value.len, n, div.shift, div.inv);
+    }
+    if (graph.lens[node] != 0) {
+        firstsets[node] = SetIndex(graph.firstchars[node]);
+        lastsets[node] = SetIndex(graph.lastchars[node]);
+    }
+    if (graph.types[node] == FlatGraph::NodeType::DISJUNCT && !Narrow(node)) {
+        for (uint32_t ref = First(node) + 1; ref < End(node); ref++) {
+            LimbRef offset = graph.Offset(ref);
+            Append(out, "static constexpr uint32_t offlimbs_%lu[] = %s;\n", (unsigned long)ref, Limbs(offset.limbs, offset.len).c_str());
+            Append(out, "static constexpr LimbRef off_%lu = {offlimbs_%lu, %u};\n", (unsigned long)ref, (unsigned long)ref, offset.len);
+        }
+    }
+}
+
+void SourceWriter::WriteSelect(uint32_t node, uint32_t lo, uint32_t hi, const std::string& indent) {
+    bool narrow = Narrow(node);
+    if (hi - lo == 1) {
+        uint32_t sub = graph.refnodes[lo];
+        if (lo == First(node)) {
+            Append(out, "%sreturn gen_%lu(%s, out);\n", indent.c_str(), (unsigned long)sub, Arg(sub, narrow, "num").c_str());
+        } else if (narrow) {
+            Append(out, "%sreturn gen_%lu(num - %s, out);\n", indent.c_str(), (unsigned long)sub, Const(Get64(graph.Offset(lo))).c_str());
+        } else {
+            Append(out, "%snum -= off_%lu;\n", indent.c_str(), (unsigned long)lo);
+            Append(out, "%sreturn gen_%lu(%s, out);\n", indent.c_str(), (unsigned long)sub, Arg(sub, narrow, "num").c_str());
+        }
+        return;
+    }
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (narrow) {
+        Append(out, "%sif (num < %s) {\n", indent.c_str(), Const(Get64(graph.Offset(mid))).c_str());
+    } else {
+        Append(out, "%sif (num.compare(off_%lu) < 0) {\n", indent.c_str(), (unsigned long)mid);
+    }
+    WriteSelect(node, lo, mid, indent + "    ");
+    Append(out, "%s}\n", indent.c_str());
+    WriteSelect(node, mid, hi, indent);
+}
+
+void SourceWriter::WriteGenerate(uint32_t node) {
+    unsigned long n = node;
+    Append(out, "static inline size_t gen_%lu(%s num, char* out) {\n", n, Narrow(node) ? "uint64_t" : "BigNum&&");
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT:
+        Append(out, "    memcpy(out, dict_%lu + num * %ld, %ld);\n", n, (long)graph.lens[node], (long)graph.lens[node]);
+        Append(out, "    return %ld;\n", (long)graph.lens[node]);
+        break;
+    case FlatGraph::NodeType::DISJUNCT:
+        WriteSelect(node, First(node), End(node), "    ");
+        break;
+    case FlatGraph::NodeType::CONCAT: {
+        // Divide by the counts of the refs in turn. Once the rest of the number fits in 64 bits,
+        // continue with that; the last ref gets what is left.
+        BigNum rest = graph.Count(node);
+        bool narrow = Narrow(node);
+        std::string var = "num";
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            unsigned long s = sub, pos = graph.refpos[ref];
+            if (!narrow && rest.limbs() <= 2) {
+                out += "    uint64_t rest = Low64(num);\n";
+                narrow = true;
+                var = "rest";
+            }
+            if (ref + 1 == End(node)) {
+                Append(out, "    gen_%lu(%s, out + %lu);\n", s, Arg(sub, narrow, var).c_str(), pos);
+            } else if (graph.CountRef(sub).len == 1 && graph.CountRef(sub).limbs[0] == 1) {
+                Append(out, "    gen_%lu(0, out + %lu);\n", s, pos);
+            } else if (narrow) {
+                std::string count = Const(Get64(graph.CountRef(sub)));
+                Append(out, "    gen_%lu(%s %% %s, out + %lu);\n", s, var.c_str(), count.c_str(), pos);
+                Append(out, "    %s /= %s;\n", var.c_str(), count.c_str());
+            } else {
+                out += "    {\n";
+                Append(out, "        BigNum div = num.divmod(div_%lu);\n", s);
+                Append(out, "        gen_%lu(%s, out + %lu);\n", s, Arg(sub, false, "num").c_str(), pos);
+                out += "        num = std::move(div);\n";
+                out += "    }\n";
+            }
+            rest = rest.divmod(graph.GetDivisor(sub));
+        }
+        Append(out, "    return %ld;\n", (long)graph.lens[node]);
+        break;
+    }
+    }
+    out += "}\n\n";
+}
+
+void SourceWriter::WriteParse(uint32_t node) {
+    unsigned long n = node;
+    bool narrow = Narrow(node);
+    Append(out, "static inline bool parse_%lu(const char* str, %s%s& out) {\n", n, Fixed(node) ? "" : "size_t len, ", Type(node));
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT:
+        Append(out, "    return Find(dict_%lu, %ld, %lu, str, out);\n", n, (long)graph.lens[node], (unsigned long)graph.dicts[First(node)].size());
+        break;
+    case FlatGraph::NodeType::DISJUNCT: {
+        bool narrowsubs = false, widesubs = false;
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            (Narrow(graph.refnodes[ref]) ? narrowsubs : widesubs) = true;
+        }
+        if (narrowsubs) {
+            out += "    uint64_t sub;\n";
+        }
+        if (widesubs) {
+            out += "    BigNum widesub;\n";
+        }
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            std::string var = Narrow(sub) ? "sub" : "widesub";
+            std::string checks = EntryChecks(sub, "str", "len", Fixed(node));
+            Append(out, "    if (%s%s%s) {\n", checks.c_str(), checks.empty() ? "" : " && ", ParseCall(sub, "str", "len", var).c_str());
+            if (narrow) {
+                if (ref == First(node)) {
+                    out += "        out = sub;\n";
+                } else {
+                    Append(out, "        out = sub + %s;\n", Const(Get64(graph.Offset(ref))).c_str());
+                }
+            } else {
+                Append(out, "        out = %s;\n", Widen(sub, var).c_str());
+                if (ref != First(node)) {
+                    Append(out, "        out += off_%lu;\n", (unsigned long)ref);
+                }
+            }
+            out += "        return true;\n";
+            out += "    }\n";
+        }
+        out += "    return false;\n";
+        break;
+    }
+    case FlatGraph::NodeType::CONCAT: {
+        // Check the boundary bytes of all refs before parsing any of them.
+        std::string checks;
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            std::string str = "str + " + std::to_string(graph.refpos[ref]);
+            if (graph.lens[sub] > 0) {
+                Append(checks, "%s!Has(set_%lu, str[%lu]) || !Has(set_%lu, str[%lu])", checks.empty() ? "" : " ||\n        ", (unsigned long)firstsets[sub], (unsigned long)graph.refpos[ref], (unsigned long)lastsets[sub], (unsigned long)(graph.refpos[ref] + graph.lens[sub] - 1));
+            }
+        }
+        if (!checks.empty()) {
+            Append(out, "    if (%s) {\n", checks.c_str());
+            out += "        return false;\n";
+            out += "    }\n";
+        }
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            Append(out, "    %s d%lu;\n", Type(sub), (unsigned long)(ref - First(node)));
+        }
+        for (uint32_t ref = First(node); ref < End(node); ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            std::string digit = "d" + std::to_string(ref - First(node));
+            Append(out, "    if (!%s) {\n", ParseCall(sub, "str + " + std::to_string(graph.refpos[ref]), "", digit).c_str());
+            out += "        return false;\n";
+            out += "    }\n";
+        }
+        // Combine the digits from the last one down, in 64 bits while the combined value fits.
+        BigNum bound(1);
+        bool wide = false;
+        std::string var = narrow ? "out" : "rest";
+        for (uint32_t ref = End(node); ref > First(node); ref--) {
+            uint32_t sub = graph.refnodes[ref - 1];
+            std::string digit = "d" + std::to_string(ref - 1 - First(node));
+            bound *= graph.Count(sub);
+            if (ref == End(node)) {
+                if (!Narrow(sub)) {
+                    Append(out, "    out = std::move(%s);\n", digit.c_str());
+                    wide = true;
+                } else {
+                    Append(out, "    %s%s = %s;\n", narrow ? "" : "uint64_t ", var.c_str(), digit.c_str());
+                }
+                continue;
+            }
+            if (graph.CountRef(sub).len == 1 && graph.CountRef(sub).limbs[0] == 1) {
+                continue;
+            }
+            if (!wide && bound.limbs() > 2) {
+                out += "    out = Wide(rest);\n";
+                wide = true;
+            }
+            if (wide) {
+                Append(out, "    out *= div_%lu.value;\n", (unsigned long)sub);
+                Append(out, "    out += %s;\n", Widen(sub, digit).c_str());
+            } else {
+                Append(out, "    %s = %s * %s + %s;\n", var.c_str(), var.c_str(), Const(Get64(graph.CountRef(sub))).c_str(), digit.c_str());
+            }
+        }
+        if (!narrow && !wide) {
+            out += "    out = Wide(rest);\n";
+        }
+        out += "    return true;\n";
+        break;
+    }
+    }
+    out += "}\n\n";
+}
+
+void SourceWriter::WriteEntry() {
+    uint32_t root = graph.root();
+    std::string checks = EntryChecks(root, "str", "len", false);
+    out += "static inline bool parse(const char* str, size_t len, BigNum& out) {\n";
+    if (Narrow(root)) {
+        out += "    uint64_t num;\n";
+        Append(out, "    if (!(%s && %s)) {\n", checks.c_str(), ParseCall(root, "str", "len", "num").c_str());
+        out += "        return false;\n";
+        out += "    }\n";
+        out += "    out = Wide(num);\n";
+        out += "    return true;\n";
+    } else {
+        Append(out, "    return %s && %s;\n", checks.c_str(), ParseCall(root, "str", "len", "out").c_str());
+    }
+    out += "}\n\n";
+}
+
+void SourceWriter::WriteApi() {
+    uint32_t root = graph.root();
+    unsigned long r = root;
+    LimbRef count = graph.CountRef(root);
+    out += "/* The length of the longest phrase. */\n";
+    Append(out, "static constexpr size_t MAX_LENGTH = %lu;\n\n", (unsigned long)graph.maxlens[root]);
+    Append(out, "static constexpr uint32_t COUNT[] = %s;\n\n", Limbs(count.limbs, count.len).c_str());
+    out += "/* The number of phrases. */\n";
+    Append(out, "static inline BigNum Count() {\n    return BigNum(COUNT, %u);\n}\n\n", count.len);
+    out += "/* Append the phrase for num, which must be below Count(), to out. */\n";
+    out += "static inline void Generate(BigNum num, std::string& out) {\n";
+    out += "    size_t pos = out.size();\n";
+    out += "    out.resize(pos + MAX_LENGTH);\n";
+    Append(out, "    size_t len = detail::gen_%lu(%s, &out[pos]);\n", r, Narrow(root) ? "detail::Low64(num)" : "std::move(num)");
+    out += "    out.resize(pos + len);\n";
+    out += "}\n\n";
+    out += "/* Set out to the number of the phrase str. Returns false if str is not a phrase. */\n";
+    out += "static inline bool Parse(const char* str, size_t len, BigNum& out) {\n";
+    out += "    return detail::parse(str, len, out);\n";
+    out += "}\n\n";
+    out += "static inline bool Parse(const std::string& str, BigNum& out) {\n";
+    out += "    return Parse(str.data(), str.size(), out);\n";
+    out += "}\n\n";
+}
+
+std::string SourceWriter::Write(const char* name) {
+    std::string guard = "_GRAMTROPY_GENERATED_";
+    for (const char* c = name; *c; c++) {
+        guard += (*c >= 'a' && *c <= 'z') ? *c - 'a' + 'A' : *c;
+    }
+    guard += "_H_";
+
+    Mark();
+    out.clear();
+    out += "/* Generated by gramc: Generate and Parse specialized for one compiled grammar. */\n\n";
+    Append(out, "#ifndef %s\n#define %s 1\n\n", guard.c_str(), guard.c_str());
+    out += "#include \"bignum.h\"\n\n";
+    out += "#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n#include <string>\n\n";
+    Append(out, "namespace %s {\n\nnamespace detail {\n\n", name);
+    WriteHelpers();
+    for (uint32_t node = 0; node < graph.size(); node++) {
+        if (reachable[node]) {
+            WriteData(node);
+            WriteGenerate(node);
+            WriteParse(node);
+        }
+    }
+    WriteEntry();
+    out += "}\n\n";
+    WriteApi();
+    out += "}\n\n#endif\n";
+    return std::move(out);
+}
+
+}
+
+void WriteSource(const FlatGraph& graph, const char* name, FILE* file) {
+    std::string source = SourceWriter(graph).Write(name);
+    fwrite(source.data(), 1, source.size(), file);
+}
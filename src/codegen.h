@@ -0,0 +1,30 @@
+#ifndef _GRAMTROPY_CODEGEN_H_
+#define _GRAMTROPY_CODEGEN_H_ 1
+
+#include <stdio.h>
+
+#include "interpreter.h"
+
+/* Write C++ source for a generator and parser specialized to graph, as a header defining, in
+ * namespace name:
+ *
+ *   MAX_LENGTH                                     the length of the longest phrase
+ *   BigNum Count()                                 the number of phrases
+ *   void Generate(BigNum num, std::string& out)    append the phrase for num < Count() to out
+ *   bool Parse(const char* str, size_t len, BigNum& out)
+ *   bool Parse(const std::string& str, BigNum& out)
+ *
+ * which number phrases exactly like Generate and Parse in interpreter.h do for graph. Every node
+ * becomes a function of its own, with the counts, offsets and dictionaries as constexpr data, so
+ * divisions are by constants and the calls can be inlined. Nodes whose count fits in 64 bits use
+ * plain integers; above that the header uses BigNum. It includes "bignum.h", which only needs the
+ * standard headers, so copy that file next to it (adding src to the include path with -I does not
+ * work, as src/strings.h would hide the system <strings.h>; -iquote src does). Everything in the
+ * header has internal linkage, so it can be included in several translation units.
+ *
+ * The source grows with the number of nodes (gram -i shows it): roughly 800 bytes per node, e.g.
+ * 8 MB for english at 64 bits (11k nodes) and 16 MB for silly at 128 bits (19k nodes), which take
+ * minutes to compile. Grammars of up to a few thousand nodes are the practical range. */
+void WriteSource(const FlatGraph& graph, const char* name, FILE* file);
+
+#endif
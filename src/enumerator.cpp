@@ -0,0 +1,86 @@
+#include "enumerator.h"
+#include <assert.h>
+
+Enumerator::Enumerator(const FlatGraph& graph_, uint32_t node, BigNum&& num) : graph(graph_), phrase(graph_.maxlens[node]), len(0) {
+    Build(node, 0, std::move(num), true, items);
+}
+
+void Enumerator::Write(const Item& item) {
+    memcpy(&phrase[item.pos], graph.dicts[graph.firsts[item.node]].StringBegin(item.sel), graph.lens[item.node]);
+}
+
+/* Append the items for the phrase of node for num to out, and write its words. With top set,
+ * node is the root or only reached through DISJUNCT nodes, so its length is the phrase's. */
+void Enumerator::Build(uint32_t node, uint32_t pos, BigNum&& num, bool top, std::vector<Item>& out) {
+    if (top && graph.lens[node] >= 0) {
+        len = graph.lens[node];
+        top = false;
+    }
+    uint32_t first = graph.firsts[node];
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT: {
+        assert(num.bits() <= 32);
+        Item item = {node, pos, num.get_ui(), 0};
+        out.push_back(item);
+        Write(item);
+        break;
+    }
+    case FlatGraph::NodeType::CONCAT:
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            BigNum div = num.divmod(graph.GetDivisor(sub));
+            Build(sub, pos + graph.refpos[ref], std::move(num), false, out);
+            num = std::move(div);
+        }
+        break;
+    case FlatGraph::NodeType::DISJUNCT: {
+        size_t start = out.size();
+        uint32_t ref = graph.SelectRef(node, num);
+        Build(graph.refnodes[ref], pos, std::move(num), top, out);
+        Item item = {node, pos, ref - first, (uint32_t)(out.size() - start)};
+        out.push_back(item);
+        break;
+    }
+    }
+}
+
+bool Enumerator::Next() {
+    for (size_t i = 0; i < items.size(); i++) {
+        Item& item = items[i];
+        if (graph.types[item.node] == FlatGraph::NodeType::DICT) {
+            if (++item.sel == graph.dicts[graph.firsts[item.node]].size()) {
+                item.sel = 0;
+            }
+            Write(item);
+            if (item.sel != 0) {
+                return true;
+            }
+            continue;
+        }
+        // Everything under this DISJUNCT node wrapped around; switch to its next ref.
+        uint32_t sel = item.sel + 1 == graph.nums[item.node] ? 0 : item.sel + 1;
+        Item disjunct = item;
+        scratch.clear();
+        Build(graph.refnodes[graph.firsts[disjunct.node] + sel], disjunct.pos, BigNum(), graph.lens[disjunct.node] < 0, scratch);
+        size_t start = i - disjunct.size;
+        items.erase(items.begin() + start, items.begin() + i);
+        items.insert(items.begin() + start, scratch.begin(), scratch.end());
+        i = start + scratch.size();
+        items[i].sel = sel;
+        items[i].size = scratch.size();
+        // The DISJUNCT nodes above this one (the later items whose subtree started at or before
+        // it, counting in positions from before the splice) now cover a different number of items.
+        if (scratch.size() != disjunct.size) {
+            for (size_t j = i + 1; j < items.size(); j++) {
+                size_t oldpos = j + disjunct.size - scratch.size();
+                if (graph.types[items[j].node] == FlatGraph::NodeType::DISJUNCT && oldpos - items[j].size <= start) {
+                    items[j].size = items[j].size + scratch.size() - disjunct.size;
+                }
+            }
+        }
+        if (sel != 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,44 @@
+#ifndef _GRAMTROPY_ENUMERATOR_H_
+#define _GRAMTROPY_ENUMERATOR_H_
+
+#include <vector>
+
+#include "interpreter.h"
+
+/* Walks through the phrases of a node in order, like calling Generate for consecutive numbers,
+ * but as an odometer: moving to the next phrase only rewrites the words that change, which
+ * takes amortized constant time.
+ *
+ * The state is kept as the tree of DICT and DISJUNCT choices that make up the current phrase,
+ * stored in order of significance (a post-order walk, with the refs of CONCAT nodes in order).
+ * Advancing increments the first choice, carrying into the next ones when it wraps around;
+ * when a DISJUNCT node switches to another ref, the choices under it are rebuilt. */
+class Enumerator {
+    struct Item {
+        uint32_t node;
+        uint32_t pos;  // Where in the phrase the node's subphrase starts.
+        uint32_t sel;  // For DICT nodes: the word; for DISJUNCT nodes: the ref index.
+        uint32_t size; // For DISJUNCT nodes: the number of items before this one that are under it.
+    };
+
+    const FlatGraph& graph;
+    std::vector<Item> items;
+    std::vector<Item> scratch;
+    std::vector<char> phrase;
+    size_t len;
+
+    void Build(uint32_t node, uint32_t pos, BigNum&& num, bool top, std::vector<Item>& out);
+    void Write(const Item& item);
+
+public:
+    /* Start at the phrase for num, which must be below the node's count. */
+    Enumerator(const FlatGraph& graph, uint32_t node, BigNum&& num);
+
+    const char* data() const { return phrase.data(); }
+    size_t size() const { return len; }
+
+    /* Move to the next phrase. Returns false after the last one, wrapping around to the first. */
+    bool Next();
+};
+
+#endif
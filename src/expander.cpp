@@ -1,14 +1,18 @@
 #include "expander.h"
 #include <algorithm>
 
-ExpGraph::Ref Expander::MakeNonDict(std::vector<ExpGraph::Ref>&& refs, ExpGraph::Node::NodeType nodetype, bool sort) {
-    if (sort) {
-        std::sort(refs.begin(), refs.end());
+ExpGraph::Ref Expander::MakeNonDict(std::vector<ExpGraph::Ref>&& refs, ExpGraph::Node::NodeType nodetype) {
+    if (nodetype == ExpGraph::Node::NodeType::DISJUNCT) {
+        // Canonical order, so equal disjunctions are found in nodemap, and come out the same
+        // however they were reached (including through the cache).
+        std::sort(refs.begin(), refs.end(), ExpGraph::RefLess());
     }
-    std::pair<ExpGraph::Node::NodeType, ComparablePointer<std::vector<ExpGraph::Ref>>> key(nodetype, MakeComparable(&refs));
-    auto fnd = nodemap.find(key);
-    if (fnd != nodemap.end()) {
-        return fnd->second;
+    uint64_t hash = ExpGraph::Node::Hash(nodetype, refs);
+    const ExpGraph::Ref* fnd = nodemap.find(hash, [&](const ExpGraph::Ref& node) { return node->nodetype == nodetype && node->refs == refs; });
+    stats.node_lookups++;
+    if (fnd) {
+        stats.node_hits++;
+        return *fnd;
     }
     ExpGraph::Ref ret;
     switch (nodetype) {
@@ -22,8 +26,7 @@ ExpGraph::Ref Expander::MakeNonDict(std::vector<ExpGraph::Ref>&& refs, ExpGraph:
         assert(!"Unknown type");
     }
     if (ret->nodetype == nodetype) {
-        key.second = &ret->refs;
-        nodemap.emplace(std::move(key), ret);
+        nodemap.insert(hash, ExpGraph::Ref(ret));
     }
     return ret;
 }
@@ -32,12 +35,15 @@ ExpGraph::Ref Expander::MakeDict(std::set<std::string>&& dict) {
     if (dict.size() == 0) {
         return ExpGraph::Ref();
     }
-    auto fnd = dictmap.find(MakeComparable(&dict));
-    if (fnd != dictmap.end()) {
-        return fnd->second;
+    uint64_t hash = ExpGraph::Node::Hash(dict);
+    const ExpGraph::Ref* fnd = dictmap.find(hash, [&](const ExpGraph::Ref& node) { return node->dict == dict; });
+    stats.dict_lookups++;
+    if (fnd) {
+        stats.dict_hits++;
+        return *fnd;
     }
     auto ret = expgraph->NewDict(std::move(dict));
-    dictmap.emplace(MakeComparable(&ret->dict), ret);
+    dictmap.insert(hash, ExpGraph::Ref(ret));
     return ret;
 }
 
@@ -45,7 +51,7 @@ ExpGraph::Ref Expander::MakeDisjunct(std::vector<ExpGraph::Ref>&& refs) {
     if (refs.size() == 0) {
         return ExpGraph::Ref();
     }
-    auto ret = MakeNonDict(std::move(refs), ExpGraph::Node::NodeType::DISJUNCT, true);
+    auto ret = MakeNonDict(std::move(refs), ExpGraph::Node::NodeType::DISJUNCT);
     if (ret->count.bits() <= 4) {
         auto inl = Inline(ret);
         return MakeDict(std::move(inl));
@@ -57,17 +63,44 @@ ExpGraph::Ref Expander::MakeConcat(std::vector<ExpGraph::Ref>&& refs) {
     if (refs.size() == 0) {
         return MakeDict({""});
     }
-    return MakeNonDict(std::move(refs), ExpGraph::Node::NodeType::CONCAT, false);
+    return MakeNonDict(std::move(refs), ExpGraph::Node::NodeType::CONCAT);
+}
+
+void Expander::SplitKeys(const Key& key, size_t s, Key& key1, Key& key2) const {
+    // Bisect the list of concatenation elements.
+    size_t total = key.ref->refs.size();
+    size_t mid = (key.offset + total - key.cutoff + 1) / 2;
+    key1 = Key(s, key.ref, key.offset, total - mid);
+    key2 = Key(key.len - s, key.ref, mid, key.cutoff);
+    // If either of the two halves result in a single node, descend into it instead.
+    if (total == key1.offset + key1.cutoff + 1) {
+        key1 = Key(s, key.ref->refs[key1.offset]);
+    }
+    if (total == key2.offset + key2.cutoff + 1) {
+        key2 = Key(key.len - s, key.ref->refs[key2.offset]);
+    }
+}
+
+const Expander::ThunkRef* Expander::FindThunk(const Key& key) const {
+    auto fnd = thunkmap.find(key.Hash(), [&](const std::pair<Key, ThunkRef>& entry) { return entry.first == key; });
+    return fnd ? &fnd->second : nullptr;
+}
+
+bool Expander::KnownEmpty(const Key& key) const {
+    const ThunkRef* fnd = FindThunk(key);
+    return fnd && (*fnd)->done && !(*fnd)->result;
 }
 
 void Expander::AddDep(const Key& key, const ThunkRef& parent) {
-    auto it = thunkmap.find(key);
+    const ThunkRef* fnd = FindThunk(key);
     ThunkRef res;
-    if (it == thunkmap.end()) {
-        res = thunks.emplace_back(key);
-        thunkmap[key] = res;
+    stats.thunk_lookups++;
+    if (!fnd) {
+        res = thunks.emplace_back(key, next_thunk++);
+        thunkmap.insert(key.Hash(), std::make_pair(key, res));
     } else {
-        res = it->second;
+        stats.thunk_hits++;
+        res = *fnd;
     }
     if (!res->done) {
         AddTodo(res);
@@ -80,6 +113,44 @@ void Expander::AddDep(const Key& key, const ThunkRef& parent) {
     }
 }
 
+ExpansionCache::Key Expander::CacheKey(const Key& key) {
+    ExpansionCache::Key ret = {cache->GraphDigest(key.ref), key.len, key.offset, key.cutoff};
+    return ret;
+}
+
+ExpGraph::Ref Expander::FromCache(uint32_t index) {
+    if (cached.size() <= index) {
+        cached.resize(cache->Nodes());
+    }
+    if (cached[index]) {
+        return cached[index];
+    }
+    const ExpansionCache::Node& node = cache->GetNode(index);
+    ExpGraph::Ref ret;
+    if (node.nodetype == ExpGraph::Node::NodeType::DICT) {
+        ret = MakeDict(std::set<std::string>(node.dict.begin(), node.dict.end()));
+    } else {
+        std::vector<ExpGraph::Ref> refs;
+        for (uint32_t sub : node.refs) {
+            refs.push_back(FromCache(sub));
+        }
+        ret = MakeNonDict(std::move(refs), node.nodetype);
+    }
+    cached[index] = ret;
+    return ret;
+}
+
+void Expander::StoreInCache() {
+    std::vector<std::pair<ExpansionCache::Key, ExpGraph::Ref>> results;
+    for (const Thunk& thunk : thunks) {
+        // Only thunks for a key are looked up; the others are parts of a CONCAT expansion.
+        if (thunk.key.ref && thunk.done) {
+            results.emplace_back(CacheKey(thunk.key), thunk.result);
+        }
+    }
+    cache->Store(results);
+}
+
 bool Expander::ProcessThunk(ThunkRef ref, std::string& error) {
 //    fprintf(stderr, "Processing thunk %p\n", &*ref);
     if (ref->done) {
@@ -87,6 +158,19 @@ bool Expander::ProcessThunk(ThunkRef ref, std::string& error) {
         return true;
     }
 
+    if (ref->need_expansion && cache) {
+        uint32_t node;
+        stats.cache_lookups++;
+        if (cache->Find(CacheKey(ref->key), node)) {
+            stats.cache_hits++;
+            ref->need_expansion = false;
+            ref->done = true;
+            if (node != ExpansionCache::NONE) {
+                ref->result = FromCache(node);
+            }
+        }
+    }
+
     if (ref->need_expansion) {
 //        fprintf(stderr, "  expanding: len=%i offset=%i\n", (int)ref->key.len, (int)ref->key.offset);
         ref->need_expansion = false;
@@ -127,32 +211,33 @@ bool Expander::ProcessThunk(ThunkRef ref, std::string& error) {
                 }
                 break;
             }
-        case Graph::Node::NodeType::CONCAT:
+        case Graph::Node::NodeType::CONCAT: {
 //            fprintf(stderr, "    concat n=%i\n", (int)ref->key.ref->refs.size());
             ref->nodetype = Thunk::ThunkType::DISJUNCT;
-            for (size_t s = 0; s <= ref->key.len; s++) {
-                // Bisect the list of concatenation elements.
-                size_t total = ref->key.ref->refs.size();
-                size_t mid = (ref->key.offset + total - ref->key.cutoff + 1) / 2;
-                Key key1(s, ref->key.ref, ref->key.offset, total - mid);
-                Key key2(ref->key.len - s, ref->key.ref, mid, ref->key.cutoff);
-                // If either of the two halves result in a single node, descend into it instead.
-                if (total == key1.offset + key1.cutoff + 1) {
-                    key1 = Key(s, ref->key.ref->refs[key1.offset]);
-                }
-                if (total == key2.offset + key2.cutoff + 1) {
-                    key2 = Key(ref->key.len - s, ref->key.ref->refs[key2.offset]);
-                }
-                // Check if we already know to have no solutions for any of the two sides.
-                auto fnd1 = thunkmap.find(key1), fnd2 = thunkmap.find(key2);
-                if (fnd1 != thunkmap.end() && fnd1->second->done && !fnd1->second->result) {
-                    continue;
+            // Find the splits for which we already know to have no solutions for any of the two
+            // sides. This only reads the thunk map, so long concatenations are checked in parallel.
+            const Key& key = ref->key;
+            std::vector<char> skip(key.len + 1);
+            auto check = [&](size_t begin, size_t end) {
+                for (size_t s = begin; s < end; s++) {
+                    Key key1, key2;
+                    SplitKeys(key, s, key1, key2);
+                    skip[s] = KnownEmpty(key1) || KnownEmpty(key2);
                 }
-                if (fnd2 != thunkmap.end() && fnd2->second->done && !fnd2->second->result) {
+            };
+            if (pool && skip.size() >= PARALLEL_MIN_SPLITS) {
+                pool->Run(skip.size(), PARALLEL_BLOCK_SPLITS, check);
+            } else {
+                check(0, skip.size());
+            }
+            for (size_t s = 0; s <= key.len; s++) {
+                if (skip[s]) {
                     continue;
                 }
+                Key key1, key2;
+                SplitKeys(key, s, key1, key2);
                 // Create thunk for the concatenation of the two halves.
-                auto sub = thunks.emplace_back();
+                auto sub = thunks.emplace_back(next_thunk++);
                 ref->deps.push_back(sub);
                 sub->forward.insert(ref);
                 sub->nodetype = Thunk::ThunkType::CONCAT;
@@ -171,6 +256,7 @@ bool Expander::ProcessThunk(ThunkRef ref, std::string& error) {
                 ref->done = true;
             }
             break;
+        }
         case Graph::Node::NodeType::DEDUP: {
             ref->nodetype = Thunk::ThunkType::DEDUP;
             assert(ref->key.ref->refs.size() == 1);
@@ -318,10 +404,11 @@ std::pair<ExpGraph::Ref, std::string> Expander::Expand(const Graph::Ref& ref, si
 
     ThunkRef dummy;
     AddDep(key, dummy);
+    ThunkRef root = *FindThunk(key);
 
     std::string error;
 
-    while (!thunkmap[key]->done && expgraph->nodes.size() <= max_nodes && thunks.size() <= max_thunks) {
+    while (!root->done && expgraph->nodes.size() <= max_nodes && thunks.size() <= max_thunks) {
         if (todo.empty()) {
             return std::make_pair(ExpGraph::Ref(), "infinite recursion");
         }
@@ -342,7 +429,7 @@ std::pair<ExpGraph::Ref, std::string> Expander::Expand(const Graph::Ref& ref, si
         return std::make_pair(ExpGraph::Ref(), "maximum thunk count exceeded");
     }
 
-    return std::make_pair(thunkmap[key]->result, "");
+    return std::make_pair(root->result, "");
 }
 
 Expander::~Expander() {
@@ -5,39 +5,48 @@
 #include "bignum.h"
 #include "graph.h"
 #include "expgraph.h"
+#include "pool.h"
+#include "hashtable.h"
+#include "expcache.h"
 
 #include <deque>
 #include <vector>
 #include <set>
-#include <map>
 
-template <typename T>
-class ComparablePointer {
-    const T* ptr;
+class Expander {
 public:
-    ComparablePointer(const T* ptr_) : ptr(ptr_) {}
-    const T& operator*() const { return *ptr; }
-    const T* operator->() const { return ptr; }
-
-    ComparablePointer& operator=(const T* ptr_) { ptr = ptr_; return *this; }
-
-    friend bool operator==(const ComparablePointer& x, const ComparablePointer& y) { return *x == *y; }
-    friend bool operator!=(const ComparablePointer& x, const ComparablePointer& y) { return *x != *y; }
-    friend bool operator<(const ComparablePointer& x, const ComparablePointer& y) { return *x < *y; }
-    friend bool operator>(const ComparablePointer& x, const ComparablePointer& y) { return *x > *y; }
-    friend bool operator<=(const ComparablePointer& x, const ComparablePointer& y) { return *x <= *y; }
-    friend bool operator>=(const ComparablePointer& x, const ComparablePointer& y) { return *x >= *y; }
-};
-
-template <typename T>
-ComparablePointer<T> MakeComparable(const T* x) { return ComparablePointer<T>(x); }
+    /* Lookups in the memo tables, and how many of them found an existing entry. */
+    struct Stats {
+        uint64_t thunk_lookups;
+        uint64_t thunk_hits;
+        uint64_t dict_lookups;
+        uint64_t dict_hits;
+        uint64_t node_lookups;
+        uint64_t node_hits;
+        uint64_t cache_lookups;
+        uint64_t cache_hits;
+
+        Stats() : thunk_lookups(0), thunk_hits(0), dict_lookups(0), dict_hits(0), node_lookups(0), node_hits(0), cache_lookups(0), cache_hits(0) {}
+    };
 
-class Expander {
+private:
     ExpGraph* expgraph;
 
     size_t max_nodes;
     size_t max_thunks;
 
+    /* Optional pool to run read-only lookups on; all state is only modified by the caller. */
+    ThreadPool* pool;
+    /* Concatenations with fewer split points are checked on the calling thread, as handing them
+     * to the pool costs more than it saves. On english -b 85, larger ones account for 8.5 of the
+     * 9.2 seconds of expansion. */
+    static const size_t PARALLEL_MIN_SPLITS = 256;
+    static const size_t PARALLEL_BLOCK_SPLITS = 32;
+
+    /* Optional persistent cache of thunk results, and the nodes created from it so far. */
+    ExpansionCache* cache;
+    std::vector<ExpGraph::Ref> cached;
+
     struct Key {
         size_t len;
         size_t offset;
@@ -48,11 +57,8 @@ class Expander {
             return x.len == y.len && x.offset == y.offset && x.cutoff == y.cutoff && x.ref == y.ref;
         }
 
-        friend bool operator<(const Key& x, const Key& y) {
-            if (x.len != y.len) return x.len < y.len;
-            if (x.cutoff != y.cutoff) return x.cutoff < y.cutoff;
-            if (x.offset != y.offset) return x.offset < y.offset;
-            return x.ref < y.ref;
+        uint64_t Hash() const {
+            return HashCombine(HashCombine(HashCombine(len, offset), cutoff), (uintptr_t)ref);
         }
 
         Key() : len(0), offset(0), cutoff(0), ref(nullptr) {}
@@ -60,11 +66,11 @@ class Expander {
         Key(size_t len_, const Graph::Node* ref_, size_t offset_ = 0, size_t cutoff_ = 0) : len(len_), offset(offset_), cutoff(cutoff_), ref(ref_) {}
     };
 
-    std::map<ComparablePointer<std::set<std::string>>, ExpGraph::Ref> dictmap;
-    std::map<std::pair<ExpGraph::Node::NodeType, ComparablePointer<std::vector<ExpGraph::Ref>>>, ExpGraph::Ref> nodemap;
-    std::map<std::set<std::string>, ExpGraph::Ref> edictmap;
+    /* Every node created through the Make* functions below, by structural hash. */
+    HashTable<ExpGraph::Ref> dictmap;
+    HashTable<ExpGraph::Ref> nodemap;
 
-    ExpGraph::Ref MakeNonDict(std::vector<ExpGraph::Ref>&& refs, ExpGraph::Node::NodeType nodetype, bool sort);
+    ExpGraph::Ref MakeNonDict(std::vector<ExpGraph::Ref>&& refs, ExpGraph::Node::NodeType nodetype);
     ExpGraph::Ref MakeConcat(std::vector<ExpGraph::Ref>&& refs);
     ExpGraph::Ref MakeDisjunct(std::vector<ExpGraph::Ref>&& refs);
     ExpGraph::Ref MakeDict(std::set<std::string>&& refs);
@@ -72,6 +78,12 @@ class Expander {
     struct Thunk;
     typedef rclist<Thunk>::fixed_iterator ThunkRef;
 
+    /* Orders thunks by creation, so that the order in which they are processed does not depend
+     * on where they were allocated. */
+    struct ThunkLess {
+        bool operator()(const ThunkRef& x, const ThunkRef& y) const { return x->seq < y->seq; }
+    };
+
     struct Thunk {
 
         enum ThunkType {
@@ -86,30 +98,47 @@ class Expander {
         bool done;
         bool todo;
 
+        uint64_t seq;
         Expander::Key key;
         ThunkType nodetype;
         ExpGraph::Ref result;
         std::vector<ThunkRef> deps;
-        std::set<ThunkRef> forward;
+        std::set<ThunkRef, ThunkLess> forward;
 
-        Thunk(const Expander::Key& key_) : need_expansion(true), done(false), todo(false), key(key_) {}
-        Thunk() : need_expansion(false), done(false), todo(false) {}
+        Thunk(const Expander::Key& key_, uint64_t seq_) : need_expansion(true), done(false), todo(false), seq(seq_), key(key_) {}
+        Thunk(uint64_t seq_) : need_expansion(false), done(false), todo(false), seq(seq_) {}
     };
 
     rclist<Thunk> thunks;
+    uint64_t next_thunk;
     std::deque<ThunkRef> todo;
-    std::map<Key, ThunkRef> thunkmap;
+    HashTable<std::pair<Key, ThunkRef>> thunkmap;
+    Stats stats;
 
+    void SplitKeys(const Key& key, size_t s, Key& key1, Key& key2) const;
+    const ThunkRef* FindThunk(const Key& key) const;
+    bool KnownEmpty(const Key& key) const;
     void AddTodo(const ThunkRef& ref, bool priority = false);
     void AddDep(const Key& key, const ThunkRef& parent);
     bool ProcessThunk(ThunkRef ref, std::string& error);
 
+    ExpansionCache::Key CacheKey(const Key& key);
+    ExpGraph::Ref FromCache(uint32_t index);
+
 public:
-    Expander(ExpGraph* expgraph_, size_t max_nodes_, size_t max_thunks_) :expgraph(expgraph_), max_nodes(max_nodes_), max_thunks(max_thunks_) {}
+    Expander(ExpGraph* expgraph_, size_t max_nodes_, size_t max_thunks_, ThreadPool* pool_ = nullptr, ExpansionCache* cache_ = nullptr) :expgraph(expgraph_), max_nodes(max_nodes_), max_thunks(max_thunks_), pool(pool_), cache(cache_), thunks(true), next_thunk(0) {}
 
     ~Expander();
 
     std::pair<ExpGraph::Ref, std::string> Expand(const Graph::Ref& ref, size_t len);
+
+    /* Thunks created so far, over all lengths expanded with this Expander. */
+    size_t Thunks() const { return thunks.size(); }
+    const Stats& GetStats() const { return stats; }
+
+    /* Add the results of all finished thunks to the cache. Must be called before the ExpGraph
+     * is optimized. */
+    void StoreInCache();
 };
 
 #endif
@@ -0,0 +1,331 @@
+#include "expcache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'G', 'T', 'C', 'A', 'C', 'H', 0, 1};
+
+/* Limits for what a valid cache file can contain; the compiler does not go beyond these. */
+static const uint64_t MAX_LEN = 65536;
+
+/* Computes a Digest as two independently seeded hash chains. */
+struct Hasher {
+    uint64_t a, b;
+
+    Hasher() : a(0x6a09e667f3bcc908ULL), b(0xbb67ae8584caa73bULL) {}
+
+    void Add(uint64_t value) {
+        a = HashCombine(a, value);
+        b = HashCombine(b, value ^ 0x3c6ef372fe94f82bULL);
+    }
+
+    void Add(const std::string& str) {
+        a = HashString(a, str);
+        b = HashString(b ^ 0x3c6ef372fe94f82bULL, str);
+    }
+
+    ExpansionCache::Digest Get() const {
+        ExpansionCache::Digest ret = {a, b};
+        return ret;
+    }
+};
+
+void writenum(uint64_t n, std::string& out) {
+    int exts = 0;
+    uint64_t nc = n;
+    while (nc >> 7) {
+        ++exts;
+        nc >>= 7;
+    }
+    while (exts) {
+        out += (char)(0x80 | ((n >> (7 * exts)) & 0x7F));
+        --exts;
+    }
+    out += (char)(n & 0x7F);
+}
+
+/* Reads numbers and strings from a loaded file, remembering whether it ran past the end. */
+struct Reader {
+    const std::vector<char>& data;
+    size_t pos;
+    bool ok;
+
+    Reader(const std::vector<char>& data_, size_t pos_) : data(data_), pos(pos_), ok(true) {}
+
+    uint64_t readnum() {
+        uint64_t ret = 0;
+        for (int i = 0; i < 10; i++) {
+            if (pos == data.size()) {
+                break;
+            }
+            uint8_t c = data[pos++];
+            ret = (ret << 7) | (c & 0x7F);
+            if (!(c & 0x80)) {
+                return ret;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    bool readstr(size_t len, std::string& out) {
+        if (data.size() - pos < len) {
+            ok = false;
+            return false;
+        }
+        out.assign(data.data() + pos, len);
+        pos += len;
+        return true;
+    }
+};
+
+}
+
+uint64_t ExpansionCache::Node::Hash() const {
+    uint64_t hash = nodetype;
+    for (uint32_t ref : refs) {
+        hash = HashCombine(hash, ref);
+    }
+    for (const auto& str : dict) {
+        hash = HashString(hash, str);
+    }
+    return hash;
+}
+
+uint32_t ExpansionCache::AddNode(Node&& node) {
+    uint64_t hash = node.Hash();
+    const uint32_t* fnd = nodeindex.find(hash, [&](uint32_t index) { return nodes[index] == node; });
+    if (fnd) {
+        return *fnd;
+    }
+    nodes.push_back(std::move(node));
+    nodeindex.insert(hash, nodes.size() - 1);
+    return nodes.size() - 1;
+}
+
+void ExpansionCache::AddEntry(const Key& key, uint32_t node) {
+    entries.emplace_back(key, node);
+    entryindex.insert(key.Hash(), entries.size() - 1);
+}
+
+bool ExpansionCache::Find(const Key& key, uint32_t& node) const {
+    const uint32_t* fnd = entryindex.find(key.Hash(), [&](uint32_t index) { return entries[index].first == key; });
+    if (!fnd) {
+        return false;
+    }
+    node = entries[*fnd].second;
+    return true;
+}
+
+uint32_t ExpansionCache::Add(const ExpGraph::Ref& ref, std::unordered_map<const ExpGraph::Node*, uint32_t>& added) {
+    auto it = added.find(&*ref);
+    if (it != added.end()) {
+        return it->second;
+    }
+    Node node;
+    node.nodetype = ref->nodetype;
+    node.len = ref->len;
+    if (ref->nodetype == ExpGraph::Node::NodeType::DICT) {
+        node.dict.assign(ref->dict.begin(), ref->dict.end());
+    } else {
+        for (const auto& sub : ref->refs) {
+            node.refs.push_back(Add(sub, added));
+        }
+    }
+    uint32_t index = AddNode(std::move(node));
+    added.emplace(&*ref, index);
+    return index;
+}
+
+void ExpansionCache::Store(const std::vector<std::pair<Key, ExpGraph::Ref>>& results) {
+    std::unordered_map<const ExpGraph::Node*, uint32_t> added;
+    for (const auto& result : results) {
+        uint32_t node;
+        if (!Find(result.first, node)) {
+            AddEntry(result.first, result.second ? Add(result.second, added) : NONE);
+        }
+    }
+}
+
+const ExpansionCache::Digest& ExpansionCache::LocalDigest(const Graph::Node* node) {
+    auto it = localdigests.find(node);
+    if (it != localdigests.end()) {
+        return it->second;
+    }
+    Hasher hasher;
+    hasher.Add(node->nodetype);
+    hasher.Add(node->par1);
+    hasher.Add(node->par2);
+    hasher.Add(node->dict.size());
+    for (const auto& str : node->dict) {
+        hasher.Add(str);
+    }
+    hasher.Add(node->refs.size());
+    return localdigests.emplace(node, hasher.Get()).first->second;
+}
+
+ExpansionCache::Digest ExpansionCache::GraphDigest(const Graph::Node* node) {
+    auto it = digests.find(node);
+    if (it != digests.end()) {
+        return it->second;
+    }
+    // Number the reachable nodes in breadth-first order, and hash their contents with the refs
+    // replaced by those numbers. The graph may contain cycles.
+    std::vector<const Graph::Node*> order(1, node);
+    std::unordered_map<const Graph::Node*, uint32_t> numbers;
+    numbers.emplace(node, 0);
+    Hasher hasher;
+    for (size_t i = 0; i < order.size(); i++) {
+        const Digest& local = LocalDigest(order[i]);
+        hasher.Add(local.a);
+        hasher.Add(local.b);
+        for (const auto& ref : order[i]->refs) {
+            auto ins = numbers.emplace(&*ref, order.size());
+            if (ins.second) {
+                order.push_back(&*ref);
+            }
+            hasher.Add(ins.first->second);
+        }
+    }
+    return digests.emplace(node, hasher.Get()).first->second;
+}
+
+bool ExpansionCache::Load(const char* file) {
+    FILE* fp = fopen(file, "r");
+    if (!fp) {
+        return true;
+    }
+    std::vector<char> data;
+    while (true) {
+        size_t pos = data.size();
+        data.resize(pos + 65536);
+        size_t len = fread(data.data() + pos, 1, 65536, fp);
+        data.resize(pos + len);
+        if (len == 0) {
+            break;
+        }
+    }
+    bool error = ferror(fp);
+    fclose(fp);
+    if (error) {
+        fprintf(stderr, "Unable to read from file '%s'\n", file);
+        return false;
+    }
+
+    bool valid = data.size() >= sizeof(CACHE_MAGIC) && memcmp(data.data(), CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0;
+    Reader reader(data, sizeof(CACHE_MAGIC));
+    // Nodes in the file are renumbered, as AddNode merges identical ones.
+    std::vector<uint32_t> renumber;
+    uint64_t count = valid ? reader.readnum() : 0;
+    for (uint64_t i = 0; valid && reader.ok && i < count; i++) {
+        Node node;
+        uint64_t type = reader.readnum();
+        uint64_t num = reader.readnum();
+        if (type == ExpGraph::Node::NodeType::DICT) {
+            uint64_t len = reader.readnum();
+            valid = num > 0 && len <= MAX_LEN && num <= data.size() - reader.pos;
+            node.len = len;
+            for (uint64_t j = 0; valid && j < num; j++) {
+                node.dict.emplace_back();
+                // Dictionaries come from sets, so they must be sorted and without duplicates.
+                valid = reader.readstr(len, node.dict.back()) && (j == 0 || node.dict[j - 1] < node.dict[j]);
+            }
+        } else if (type == ExpGraph::Node::NodeType::CONCAT || type == ExpGraph::Node::NodeType::DISJUNCT) {
+            valid = num >= 2 && num <= renumber.size();
+            for (uint64_t j = 0; valid && j < num; j++) {
+                uint64_t back = reader.readnum();
+                valid = back < renumber.size();
+                if (valid) {
+                    uint32_t ref = renumber[renumber.size() - back - 1];
+                    int sublen = nodes[ref].len;
+                    if (type == ExpGraph::Node::NodeType::CONCAT) {
+                        valid = sublen >= 0;
+                        node.len = j == 0 ? sublen : node.len + sublen;
+                    } else {
+                        node.len = j == 0 || node.len == sublen ? sublen : -1;
+                    }
+                    node.refs.push_back(ref);
+                }
+            }
+        } else {
+            valid = false;
+        }
+        node.nodetype = (ExpGraph::Node::NodeType)type;
+        valid = valid && node.len <= (int)MAX_LEN;
+        if (valid) {
+            renumber.push_back(AddNode(std::move(node)));
+        }
+    }
+    count = valid ? reader.readnum() : 0;
+    for (uint64_t i = 0; valid && reader.ok && i < count; i++) {
+        Key key;
+        key.graph.a = reader.readnum();
+        key.graph.b = reader.readnum();
+        key.len = reader.readnum();
+        key.offset = reader.readnum();
+        key.cutoff = reader.readnum();
+        uint64_t node = reader.readnum();
+        uint32_t old;
+        // Every result consists of phrases of the key's length.
+        valid = key.len <= MAX_LEN && node <= renumber.size() && (node == 0 || nodes[renumber[node - 1]].len == (int)key.len) && !Find(key, old);
+        if (valid) {
+            AddEntry(key, node ? renumber[node - 1] : NONE);
+        }
+    }
+    if (!valid || !reader.ok || reader.pos != data.size()) {
+        fprintf(stderr, "Ignoring invalid cache file '%s'\n", file);
+        nodes.clear();
+        nodeindex.clear();
+        entries.clear();
+        entryindex.clear();
+    }
+    return true;
+}
+
+bool ExpansionCache::Save(const char* file) const {
+    std::string out(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    writenum(nodes.size(), out);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const Node& node = nodes[i];
+        writenum(node.nodetype, out);
+        if (node.nodetype == ExpGraph::Node::NodeType::DICT) {
+            writenum(node.dict.size(), out);
+            writenum(node.len, out);
+            for (const auto& str : node.dict) {
+                out += str;
+            }
+        } else {
+            writenum(node.refs.size(), out);
+            for (uint32_t ref : node.refs) {
+                writenum(i - ref - 1, out);
+            }
+        }
+    }
+    writenum(entries.size(), out);
+    for (const auto& entry : entries) {
+        writenum(entry.first.graph.a, out);
+        writenum(entry.first.graph.b, out);
+        writenum(entry.first.len, out);
+        writenum(entry.first.offset, out);
+        writenum(entry.first.cutoff, out);
+        writenum(entry.second == NONE ? 0 : entry.second + 1, out);
+    }
+
+    // Write a new file and move it in place, so an interrupted run leaves the old cache intact.
+    std::string tmp = std::string(file) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file '%s'\n", tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), file) != 0) {
+        fprintf(stderr, "Unable to write file '%s'\n", file);
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
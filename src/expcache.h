@@ -0,0 +1,102 @@
+#ifndef _GRAMTROPY_EXPCACHE_H_
+#define _GRAMTROPY_EXPCACHE_H_ 1
+
+#include "graph.h"
+#include "expgraph.h"
+#include "hashtable.h"
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* A persistent store of expansion results, so that compiling a grammar again after editing some
+ * of its rules only expands what the edits affect.
+ *
+ * Results are keyed by a structural digest of everything reachable from a Graph node (so two
+ * rules that expand the same way share entries, and editing a rule only changes the digests of
+ * the rules that use it), together with the length, offset and cutoff of the Expander key. The
+ * results themselves are kept as a DAG of cache nodes mirroring ExpGraph nodes, with identical
+ * nodes shared. Compiling with a cache gives the same translation file as without one, as the
+ * expander and Export order nodes by content rather than by creation (util/check.sh tests this).
+ *
+ * File format: magic (8 bytes), then variable-length integers (7 bits per byte, most significant
+ * first, like translation files):
+ *   node count, then per node: type; for DICT: string count, length, and the strings;
+ *                              otherwise: ref count, and per ref the distance back to it minus 1
+ *   entry count, then per entry: digest (2 numbers), len, offset, cutoff, node index + 1 (or 0
+ *                                if there are no phrases) */
+class ExpansionCache {
+public:
+    struct Digest {
+        uint64_t a, b;
+
+        friend bool operator==(const Digest& x, const Digest& y) { return x.a == y.a && x.b == y.b; }
+    };
+
+    struct Key {
+        Digest graph;
+        uint64_t len;
+        uint64_t offset;
+        uint64_t cutoff;
+
+        friend bool operator==(const Key& x, const Key& y) {
+            return x.graph == y.graph && x.len == y.len && x.offset == y.offset && x.cutoff == y.cutoff;
+        }
+
+        uint64_t Hash() const {
+            return HashCombine(HashCombine(HashCombine(graph.a, len), offset), cutoff);
+        }
+    };
+
+    struct Node {
+        ExpGraph::Node::NodeType nodetype;
+        std::vector<uint32_t> refs;
+        std::vector<std::string> dict;
+        int len; // -1 if the phrases vary in length.
+
+        uint64_t Hash() const;
+        friend bool operator==(const Node& x, const Node& y) {
+            return x.nodetype == y.nodetype && x.refs == y.refs && x.dict == y.dict;
+        }
+    };
+
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+private:
+    std::vector<Node> nodes;
+    HashTable<uint32_t> nodeindex;
+    std::vector<std::pair<Key, uint32_t>> entries;
+    HashTable<uint32_t> entryindex;
+
+    std::unordered_map<const Graph::Node*, Digest> localdigests;
+    std::unordered_map<const Graph::Node*, Digest> digests;
+
+    const Digest& LocalDigest(const Graph::Node* node);
+    uint32_t AddNode(Node&& node);
+    void AddEntry(const Key& key, uint32_t node);
+    uint32_t Add(const ExpGraph::Ref& ref, std::unordered_map<const ExpGraph::Node*, uint32_t>& added);
+
+public:
+    /* Read the cache from file. A missing file leaves the cache empty; an invalid one is reported
+     * and ignored. Returns false only for read errors. */
+    bool Load(const char* file);
+    bool Save(const char* file) const;
+
+    /* Digest of the part of the graph reachable from node. Must not be used after the graph
+     * changes. */
+    Digest GraphDigest(const Graph::Node* node);
+
+    /* Find the result for key. Returns false if unknown; otherwise sets node to its index, or to
+     * NONE if there are no phrases for the key. */
+    bool Find(const Key& key, uint32_t& node) const;
+
+    /* Add results that are not known yet. */
+    void Store(const std::vector<std::pair<Key, ExpGraph::Ref>>& results);
+
+    const Node& GetNode(uint32_t index) const { return nodes[index]; }
+    size_t Nodes() const { return nodes.size(); }
+    size_t Entries() const { return entries.size(); }
+};
+
+#endif
@@ -3,6 +3,31 @@
 #include "expgraph.h"
 
 #include <string.h>
+#include <algorithm>
+
+uint64_t ExpGraph::Node::Hash(const std::set<std::string>& dict) {
+    uint64_t hash = NodeType::DICT;
+    for (const auto& str : dict) {
+        hash = HashString(hash, str);
+    }
+    return hash;
+}
+
+uint64_t ExpGraph::Node::Hash(NodeType nodetype, const std::vector<Ref>& refs) {
+    uint64_t hash = nodetype;
+    for (const auto& ref : refs) {
+        hash = HashCombine(hash, ref->hash);
+    }
+    return hash;
+}
+
+bool ExpGraph::Node::Less(const Node& x, const Node& y) {
+    if (&x == &y) return false;
+    if (x.hash != y.hash) return x.hash < y.hash;
+    if (x.nodetype != y.nodetype) return x.nodetype < y.nodetype;
+    if (x.nodetype == NodeType::DICT) return x.dict < y.dict;
+    return std::lexicographical_compare(x.refs.begin(), x.refs.end(), y.refs.begin(), y.refs.end(), RefLess());
+}
 
 ExpGraph::Ref ExpGraph::NewDict(std::set<std::string>&& dict) {
     assert(dict.size() > 0);
@@ -10,6 +35,7 @@ ExpGraph::Ref ExpGraph::NewDict(std::set<std::string>&& dict) {
     ret->dict = std::move(dict);
     ret->count = ret->dict.size();
     ret->len = ret->dict.begin()->size();
+    ret->hash = Node::Hash(ret->dict);
     return std::move(ret);
 }
 
@@ -29,6 +55,7 @@ ExpGraph::Ref ExpGraph::NewConcat(std::vector<Ref>&& refs) {
     ret->count = std::move(count);
     ret->refs = std::move(refs);
     ret->len = len;
+    ret->hash = Node::Hash(ret->nodetype, ret->refs);
     return std::move(ret);
 }
 
@@ -49,6 +76,7 @@ ExpGraph::Ref ExpGraph::NewDisjunct(std::vector<Ref>&& refs) {
     ret->count = std::move(count);
     ret->refs = std::move(refs);
     ret->len = len;
+    ret->hash = Node::Hash(ret->nodetype, ret->refs);
     return std::move(ret);
 }
 
@@ -4,6 +4,7 @@
 #include "rclist.h"
 #include "bignum.h"
 #include "graph.h"
+#include "hashtable.h"
 
 #include <vector>
 
@@ -26,10 +27,29 @@ public:
         std::vector<Ref> refs;
         std::set<std::string> dict;
         int len;
+        /* Structural hash, as computed by Hash() when the node was created. Optimize does not
+         * update it. It only depends on the contents of the node and its descendants, so it is
+         * the same across runs, thread counts and platforms. */
+        uint64_t hash;
 
-        Node(NodeType nodetype_) : nodetype(nodetype_), len(-1) {}
+        Node(NodeType nodetype_) : nodetype(nodetype_), len(-1), hash(0) {}
+
+        static uint64_t Hash(const std::set<std::string>& dict);
+        static uint64_t Hash(NodeType nodetype, const std::vector<Ref>& refs);
+
+        /* A total order on nodes by content: by hash, and for equal hashes by comparing the
+         * nodes themselves. Unlike comparing Refs, which compares addresses, this does not depend
+         * on how nodes were allocated, so output ordered by it is reproducible. */
+        static bool Less(const Node& x, const Node& y);
     };
 
+    /* Orders Refs by Node::Less. */
+    struct RefLess {
+        bool operator()(const Ref& x, const Ref& y) const { return Node::Less(*x, *y); }
+    };
+
+    ExpGraph() : nodes(true) {}
+
     Ref NewDict(std::set<std::string>&& dict);
     Ref NewConcat(std::vector<Ref>&& refs);
     Ref NewDisjunct(std::vector<Ref>&& refs);
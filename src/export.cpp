@@ -1,7 +1,10 @@
 #include "export.h"
+#include "perfecthash.h"
 #include <algorithm>
 #include <math.h>
 #include <map>
+#include <set>
+#include <tuple>
 
 namespace {
 
@@ -28,6 +31,27 @@ void writenum(uint64_t n, FILE* f) {
     putc(n & 0x7F, f);
 }
 
+/* The nodes reachable from ref, each after the nodes it refers to. The order only depends on the
+ * structure of the graph, not on the order in which the nodes were created. */
+std::vector<const ExpGraph::Node*> PostOrder(const ExpGraph::Ref& ref) {
+    std::vector<const ExpGraph::Node*> order;
+    std::set<const ExpGraph::Node*> seen;
+    std::vector<std::pair<const ExpGraph::Node*, size_t>> stack;
+    seen.insert(&*ref);
+    stack.emplace_back(&*ref, 0);
+    while (!stack.empty()) {
+        const ExpGraph::Node* node = stack.back().first;
+        size_t pos = stack.back().second++;
+        if (pos == node->refs.size()) {
+            order.push_back(node);
+            stack.pop_back();
+        } else if (seen.insert(&*node->refs[pos]).second) {
+            stack.emplace_back(&*node->refs[pos], 0);
+        }
+    }
+    return order;
+}
+
 }
 
 /* c1 * s1 + c2 * (f1 + s2) + c3 * (f1 + f2 + s3) + c4 * (f1 + f2 + f3 + s4)
@@ -37,7 +61,7 @@ f1 * (c2 + c3 + c4) + f2 * (c3 + c4) + f3 * (c4)
 - (f1 * c1 + f2 * (c1 + c2) + f3 * (c1 + c2 + c3)) */
 
 
-void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
+void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file, bool hashes) {
     int cnt = 0;
     BigNum big = 1;
     double small = 1.0;
@@ -46,7 +70,9 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
         small *= 0.000000001;
     }
     std::map<const ExpGraph::Node*, NodeData> dump;
-    for (const auto& node : expgraph.nodes) {
+    std::vector<const ExpGraph::Node*> dicts;
+    for (const ExpGraph::Node* nodeptr : PostOrder(ref)) {
+        const ExpGraph::Node& node = *nodeptr;
         auto it = dump.emplace(&node, cnt);
         NodeData& data = it.first->second;
 //        fprintf(stderr, "Export node %i (%s combinations)\n", cnt, node.count.hex().str_c());
@@ -69,14 +95,17 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
             }
             data.success = cost + 1.0;
             data.fail = cost + 2.0;
+            dicts.push_back(&node);
         } else if (node.nodetype == ExpGraph::Node::NodeType::CONCAT) {
 //            fprintf(stderr, "* Cat of %i\n", (int)node.refs.size());
             size_t pos = 0;
-            std::vector<std::tuple<double, const ExpGraph::Node*, int>> subs;
+            // Ties are broken by node number and then position, which are unique, so the address
+            // is only carried along for the lookup below.
+            std::vector<std::tuple<double, int, int, const ExpGraph::Node*>> subs;
             for (size_t s = 0; s < node.refs.size(); s++) {
                 auto it2 = dump.find(&*node.refs[s]);
                 const NodeData& subdata = it2->second;
-                subs.emplace_back(subdata.fail, &*node.refs[s], pos);
+                subs.emplace_back(subdata.fail, subdata.number, pos, &*node.refs[s]);
                 assert(node.refs[s]->len >= 0);
                 pos += node.refs[s]->len;
             }
@@ -86,7 +115,7 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
             writenum(4 * node.refs.size() - 6, file);
             std::sort(subs.begin(), subs.end());
             for (const auto& sub : subs) {
-                auto it2 = dump.find(std::get<1>(sub));
+                auto it2 = dump.find(std::get<3>(sub));
                 const NodeData& subdata = it2->second;
                 fail += (success + subdata.fail) * fact;
                 success += subdata.success;
@@ -100,11 +129,12 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
 //            fprintf(stderr, "  * Total: %s combinations\n", node.count.hex().c_str());
         } else {
 //            fprintf(stderr, "* Disjunct of %i\n", (int)node.refs.size());
-            std::vector<std::pair<double, const ExpGraph::Node*>> subs;
+            // As above, equal costs are ordered by node number.
+            std::vector<std::tuple<double, int, const ExpGraph::Node*>> subs;
             for (size_t s = 0; s < node.refs.size(); s++) {
                 auto it2 = dump.find(&*node.refs[s]);
                 const NodeData& subdata = it2->second;
-                subs.emplace_back(subdata.fail / node.refs[s]->count.get_d(), &*node.refs[s]);
+                subs.emplace_back(subdata.fail / node.refs[s]->count.get_d(), subdata.number, &*node.refs[s]);
             }
             double success = 0;
             double fail = 0;
@@ -113,9 +143,9 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
                 std::sort(subs.begin(), subs.end());
             }
             for (const auto& sub : subs) {
-                auto it2 = dump.find(sub.second);
+                auto it2 = dump.find(std::get<2>(sub));
                 const NodeData& subdata = it2->second;
-                BigNum x = sub.second->count * big;
+                BigNum x = std::get<2>(sub)->count * big;
                 BigNum ratio = x.divmod(node.count);
                 success += (fail + subdata.success) * (ratio.get_d() * small);
                 fail += subdata.fail;
@@ -127,11 +157,26 @@ void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file) {
 //            fprintf(stderr, "  * Total: %s combinations\n", node.count.hex().c_str());
         }
 //        fprintf(stderr, "* cost (%g suc, %g fail)\n", data.success, data.fail);
-        if (ref && &*ref == &node) {
-            break;
-        }
         cnt++;
     }
     writenum(0, file);
+    if (hashes) {
+        writenum(1, file);
+        std::vector<uint64_t> words;
+        std::vector<uint32_t> seeds;
+        for (const ExpGraph::Node* node : dicts) {
+            words.clear();
+            for (const auto& str : node->dict) {
+                words.push_back(PerfectHashWord(str.data(), str.size()));
+            }
+            if (!BuildPerfectHash(words, seeds)) {
+                seeds.clear();
+            }
+            writenum(seeds.size(), file);
+            for (uint32_t seed : seeds) {
+                writenum(seed, file);
+            }
+        }
+    }
 }
 
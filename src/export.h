@@ -5,6 +5,10 @@
 
 #include "expgraph.h"
 
-void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file);
+/* Write the translation file for ref. With hashes, the nodes are followed by perfect hash seeds for
+ * the dictionaries (see perfecthash.h): the number 1, and then per DICT node, in order, the
+ * number of seeds and the seeds (0 seeds for a dictionary without a perfect hash). Interpreters
+ * that do not know about them stop reading at the 0 that ends the nodes. */
+void Export(ExpGraph& expgraph, const ExpGraph::Ref& ref, FILE* file, bool hashes);
 
 #endif
@@ -0,0 +1,68 @@
+#ifndef _GRAMTROPY_FLATARRAY_H_
+#define _GRAMTROPY_FLATARRAY_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <vector>
+
+/* A read-mostly array that either owns its elements, and can then be appended to, or refers to
+ * elements in externally owned memory (such as a mapped image file) without copying them. Either
+ * way, reading goes through a single pointer, as with std::vector. */
+template<typename T>
+class FlatArray {
+    std::vector<T> owned;
+    const T* ptr;
+    size_t len;
+
+public:
+    FlatArray() : ptr(nullptr), len(0) {}
+    FlatArray(size_t n, const T& val) : owned(n, val), ptr(owned.data()), len(n) {}
+    explicit FlatArray(std::vector<T>&& vec) : owned(std::move(vec)), ptr(owned.data()), len(owned.size()) {}
+
+    /* Refer to the n elements at data, which must outlive the array. */
+    FlatArray(const T* data, size_t n) : ptr(data), len(n) {}
+
+    // Moving a vector keeps its elements in place, so ptr stays valid.
+    FlatArray(FlatArray&& x) : owned(std::move(x.owned)), ptr(x.ptr), len(x.len) {
+        x.ptr = nullptr;
+        x.len = 0;
+    }
+
+    FlatArray& operator=(FlatArray&& x) {
+        if (&x != this) {
+            owned = std::move(x.owned);
+            ptr = x.ptr;
+            len = x.len;
+            x.ptr = nullptr;
+            x.len = 0;
+        }
+        return *this;
+    }
+
+    FlatArray(const FlatArray&) = delete;
+    FlatArray& operator=(const FlatArray&) = delete;
+
+    void push_back(const T& val) {
+        assert(owned.size() == len); // Not a reference to external memory.
+        owned.push_back(val);
+        ptr = owned.data();
+        len++;
+    }
+
+    void append(const T* data, size_t n) {
+        assert(owned.size() == len);
+        owned.insert(owned.end(), data, data + n);
+        ptr = owned.data();
+        len += n;
+    }
+
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + len; }
+    const T& back() const { return ptr[len - 1]; }
+    const T& operator[](size_t pos) const { return ptr[pos]; }
+};
+
+#endif
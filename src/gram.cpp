@@ -1,37 +1,206 @@
 #include "interpreter.h"
+#include "enumerator.h"
 #include "import.h"
+#include "image.h"
+#include "server.h"
+#include "stream.h"
+#include "rng.h"
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 namespace {
 
-bool RandomInteger(const BigNum& range, BigNum& out) {
-    int bits = range.bits();
-    std::vector<uint8_t> data;
-    data.resize((bits + 7)/8);
-    FILE* rng = fopen("/dev/urandom", "r");
-    do {
-        size_t r = fread(&data[0], data.size(), 1, rng);
-        if (r != 1) {
-            fprintf(stderr, "Unable to read from RNG");
+/* Serializes output from multiple threads into a single file. */
+class OutputWriter {
+    std::mutex mutex;
+    FILE* file;
+
+public:
+    explicit OutputWriter(FILE* file_) : file(file_) {}
+
+    void Write(const std::string& data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        fwrite(data.data(), 1, data.size(), file);
+    }
+};
+
+static const size_t OUTPUT_CHUNK = 65536;
+
+/* Decoding costs far more per input byte than encoding, so split its input more finely. */
+static const size_t DECODE_CHUNK_SIZE = 65536;
+
+bool Generate(const FlatGraph& graph, uint32_t node, const BigNum& range, RandomSource& rng, std::string& out) {
+    BigNum num;
+    if (!rng.RandomInteger(range, num)) {
+        return false;
+    }
+    Generate(graph, node, std::move(num), out);
+    out += '\n';
+    return true;
+}
+
+void GenerateWorker(const FlatGraph& graph, uint32_t node, bool bulk, size_t count, OutputWriter& writer, std::atomic<bool>& failed) {
+    RandomSource rng(bulk);
+    BigNum range = graph.Count(node);
+    std::string out;
+    while (count-- && !failed) {
+        if (!Generate(graph, node, range, rng, out)) {
+            failed = true;
+            break;
+        }
+        if (out.size() >= OUTPUT_CHUNK) {
+            writer.Write(out);
+            out.clear();
+        }
+    }
+    writer.Write(out);
+}
+
+/* Generate count phrases using the specified number of threads, each with its own RNG stream. */
+bool GenerateParallel(const FlatGraph& graph, uint32_t node, bool bulk, size_t count, int threads) {
+    OutputWriter writer(stdout);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++) {
+        size_t num = count / threads + ((size_t)i < count % threads);
+        workers.emplace_back(GenerateWorker, std::cref(graph), node, bulk, num, std::ref(writer), std::ref(failed));
+    }
+    GenerateWorker(graph, node, bulk, count / threads + (0 < count % threads), writer, failed);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return !failed;
+}
+
+/* Append the phrases for count consecutive numbers, starting at start, to out. With file set,
+ * out is written to it and cleared whenever it grows past OUTPUT_CHUNK. */
+void EnumerateRange(const FlatGraph& graph, uint32_t node, BigNum&& start, const BigNum& count, std::string& out, FILE* file) {
+    Enumerator enumerator(graph, node, std::move(start));
+    for (BigNum done; done < count; done++) {
+        out.append(enumerator.data(), enumerator.size());
+        out += '\n';
+        if (file && out.size() >= OUTPUT_CHUNK) {
+            fwrite(out.data(), 1, out.size(), file);
+            out.clear();
+        }
+        enumerator.Next();
+    }
+}
+
+/* Print the phrases for count consecutive numbers, starting at start. */
+void PrintRange(const FlatGraph& graph, uint32_t node, BigNum&& start, const BigNum& count) {
+    std::string out;
+    EnumerateRange(graph, node, std::move(start), count, out, stdout);
+    fwrite(out.data(), 1, out.size(), stdout);
+}
+
+static const uint32_t DEFAULT_RANGE_CHUNK = 65536;
+static const int RANGE_CHUNKS_PER_THREAD = 4;
+
+struct RangeChunk {
+    BigNum start;
+    uint32_t count;
+    uint64_t index;
+    std::string output;
+};
+
+/* Enumerate a chunk into its output, or with prefix set, into the file prefix.index. */
+bool ProcessRangeChunk(const FlatGraph& graph, uint32_t node, RangeChunk& chunk, const char* prefix) {
+    chunk.output.clear();
+    if (!prefix) {
+        EnumerateRange(graph, node, BigNum(chunk.start), chunk.count, chunk.output, nullptr);
+        return true;
+    }
+    std::string name = std::string(prefix) + "." + std::to_string(chunk.index);
+    FILE* fp = fopen(name.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file '%s'\n", name.c_str());
+        return false;
+    }
+    EnumerateRange(graph, node, BigNum(chunk.start), chunk.count, chunk.output, fp);
+    fwrite(chunk.output.data(), 1, chunk.output.size(), fp);
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok) {
+        fprintf(stderr, "Unable to write file '%s'\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Like PrintRange, but split into chunks of chunksize phrases that are enumerated on the
+ * specified number of threads. The chunks are printed in order, or with prefix set, chunk i is
+ * written to the file prefix.i instead. */
+bool PrintRangeParallel(const FlatGraph& graph, uint32_t node, BigNum&& start, BigNum&& count, int threads, uint32_t chunksize, const char* prefix) {
+    std::vector<RangeChunk> chunks(threads * RANGE_CHUNKS_PER_THREAD);
+    uint64_t index = 0;
+    while (count > 0) {
+        size_t num = 0;
+        while (num < chunks.size() && count > 0) {
+            RangeChunk& chunk = chunks[num++];
+            chunk.start = start;
+            chunk.count = count < chunksize ? count.get_ui() : chunksize;
+            chunk.index = index++;
+            start += chunk.count;
+            count -= chunk.count;
+        }
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]() {
+            size_t i;
+            while (!failed && (i = next++) < num) {
+                if (!ProcessRangeChunk(graph, node, chunks[i], prefix)) {
+                    failed = true;
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (int i = 1; i < threads && (size_t)i < num; i++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        if (failed) {
             return false;
         }
-        if (bits % 8) {
-            data[0] >>= (8 - (bits % 8));
+        if (!prefix) {
+            for (size_t i = 0; i < num; i++) {
+                fwrite(chunks[i].output.data(), 1, chunks[i].output.size(), stdout);
+            }
         }
-        out = BigNum(&data[0], data.size());
-    } while (out >= range);
-    fclose(rng);
+    }
     return true;
 }
 
-bool Generate(const FlatGraph& graph, const FlatNode* ref) {
+int EncodeLine(const FlatGraph& graph, uint32_t node, const char* line, size_t len, std::string& out, std::string& err) {
     BigNum num;
-    if (!RandomInteger(ref->count, num)) {
-        return false;
+    if (!num.set_hex(line, len)) {
+        err = "Cannot parse hex number '" + std::string(line, len) + "'\n";
+        return 4;
     }
-    printf("%s\n", Generate(graph, ref, std::move(num)).c_str());
-    return true;
+    if (num.compare(graph.CountRef(node)) >= 0) {
+        err = "Number " + num.hex() + " out of range (max " + graph.Count(node).hex() + ")\n";
+        return 5;
+    }
+    Generate(graph, node, std::move(num), out);
+    out += '\n';
+    return 0;
+}
+
+int DecodeLine(const FlatGraph& graph, uint32_t node, const char* line, size_t len, std::string& out, std::string& err) {
+    BigNum num;
+    if (!Parse(graph, node, line, len, num)) {
+        out += "-1\n";
+    } else {
+        num.hex(out);
+        out += '\n';
+    }
+    return 0;
 }
 
 bool ParseFile(const char *file, FlatGraph& graph) {
@@ -40,8 +209,36 @@ bool ParseFile(const char *file, FlatGraph& graph) {
         fprintf(stderr, "Unable to open file '%s'\n", file);
         return false;
     }
+    // Leave out the version, so that images of other versions are reported as invalid images.
+    char magic[sizeof(IMAGE_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0) {
+        fclose(fp);
+        if (!LoadImage(graph, file)) {
+            fprintf(stderr, "Invalid image file '%s'\n", file);
+            return false;
+        }
+        return true;
+    }
+    rewind(fp);
     Import(graph, fp);
     fclose(fp);
+    // Import stops at the end of the file, so an empty or unrelated file (or a directory) gives
+    // a graph without nodes, which has no root to use.
+    if (graph.size() == 0) {
+        fprintf(stderr, "Invalid translation file '%s'\n", file);
+        return false;
+    }
+    return true;
+}
+
+bool WriteFile(const char *file, const FlatGraph& graph) {
+    FILE* fp = fopen(file, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file '%s'\n", file);
+        return false;
+    }
+    WriteImage(graph, fp);
+    fclose(fp);
     return true;
 }
 
@@ -54,6 +251,8 @@ enum RunMode {
     MODE_DECODE_STREAM,
     MODE_INFO,
     MODE_ITERATE,
+    MODE_IMAGE,
+    MODE_SERVER,
     MODE_HELP,
 };
 
@@ -61,10 +260,14 @@ enum RunMode {
 
 int main(int argc, char** argv) {
     RunMode mode = MODE_GENERATE;
-    int generate = 1;
+    size_t generate = 1;
+    bool bulk = false;
+    int threads = 1;
+    unsigned long chunksize = DEFAULT_RANGE_CHUNK;
+    const char* prefix = nullptr;
     int opt;
     const char* str = nullptr;
-    while ((opt = getopt(argc, argv, "iaDEr:d:e:g:h")) != -1) {
+    while ((opt = getopt(argc, argv, "iaDEcr:d:e:g:j:n:o:S:W:h")) != -1) {
         switch (opt) {
         case 'i':
             mode = MODE_INFO;
@@ -94,14 +297,49 @@ int main(int argc, char** argv) {
             mode = MODE_GENERATE;
             generate = strtoul(optarg, NULL, 10);
             break;
+        case 'c':
+            bulk = true;
+            break;
+        case 'j': {
+            char* end;
+            long val = strtol(optarg, &end, 10);
+            // Check before narrowing to int; anything invalid becomes 0, which is rejected below.
+            threads = (*optarg && *end == 0 && val >= 1 && val <= 1024) ? (int)val : 0;
+            break;
+        }
+        case 'n':
+            chunksize = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        case 'S':
+            mode = MODE_SERVER;
+            str = optarg;
+            break;
+        case 'W':
+            mode = MODE_IMAGE;
+            str = optarg;
+            break;
         case 'h':
             mode = MODE_HELP;
             break;
         }
     }
 
+    if (threads < 1 || threads > 1024) {
+        fprintf(stderr, "Thread count out of range (1-1024)\n");
+        return 1;
+    }
+    if (chunksize < 1 || chunksize > 0xFFFFFFFF) {
+        fprintf(stderr, "Chunk size out of range (1-4294967295)\n");
+        return 1;
+    }
+
     if (mode == MODE_HELP || optind + 1 > argc) {
         fprintf(stderr, "Usage: %s [-g n] file      Generate n random phrases (default 1)\n", *argv);
+        fprintf(stderr, "       %s -c [-g n] file   Same, using a ChaCha20 stream seeded from the OS RNG\n", *argv);
+        fprintf(stderr, "       %s -j n ...         Use n threads for -g, -E, -D, -a and -r\n", *argv);
         fprintf(stderr, "       %s -e hexnum file   Encode hexadecimal into phrase\n", *argv);
         fprintf(stderr, "       %s -d str file      Decode phrase into hexadecimal \n", *argv);
         fprintf(stderr, "       %s -E file          Encode hexadecimals read from stdin\n", *argv);
@@ -109,31 +347,51 @@ int main(int argc, char** argv) {
         fprintf(stderr, "       %s -i file          Show information about file\n", *argv);
         fprintf(stderr, "       %s -a file          Generate all phrases from file, in order\n", *argv);
         fprintf(stderr, "       %s -r num:num file  Encode range of hexadecimals into phrase\n", *argv);
+        fprintf(stderr, "       %s -o prefix ...    Write -a and -r output to files prefix.0, prefix.1, ... of one chunk each\n", *argv);
+        fprintf(stderr, "       %s -n n ...         Use chunks of n phrases for -a and -r with -j or -o (default %u)\n", *argv, (unsigned)DEFAULT_RANGE_CHUNK);
+        fprintf(stderr, "       %s -W out file      Convert file into a memory-mappable image out\n", *argv);
+        fprintf(stderr, "       %s -S path file...  Serve requests for the files on Unix socket path\n", *argv);
         return mode != MODE_HELP;
     }
 
+    if (mode == MODE_SERVER) {
+        std::vector<FlatGraph> graphs(argc - optind);
+        std::vector<ServedGrammar> grammars;
+        for (int i = optind; i < argc; i++) {
+            if (!ParseFile(argv[i], graphs[i - optind])) {
+                return 2;
+            }
+            // Serve each file under its name without directory and extension.
+            std::string name = argv[i];
+            name = name.substr(name.rfind('/') + 1);
+            name = name.substr(0, name.find('.'));
+            grammars.push_back(ServedGrammar{name, &graphs[i - optind]});
+        }
+        return RunServer(str, grammars, bulk) ? 0 : 7;
+    }
+
     FlatGraph graph;
     if (!ParseFile(argv[optind], graph)) {
         return 2;
     }
-    const FlatNode* main = &graph.nodes.back();
+    uint32_t main = graph.root();
+    BigNum count = graph.Count(main);
 
     switch (mode) {
     case MODE_GENERATE:
-        while (generate--) {
-            if (!Generate(graph, main)) {
-                return 3;
-            }
+        if (!GenerateParallel(graph, main, bulk, generate, threads)) {
+            return 3;
         }
         break;
     case MODE_ITERATE:
-    {
-        BigNum num;
-        do {
-            printf("%s\n", Generate(graph, main, BigNum(num)).c_str());
-            num += 1;
-        } while(true);
-    }
+        if (threads > 1 || prefix) {
+            if (!PrintRangeParallel(graph, main, BigNum(), std::move(count), threads, chunksize, prefix)) {
+                return 6;
+            }
+        } else {
+            PrintRange(graph, main, BigNum(), count);
+        }
+        break;
     case MODE_RANGE:
     {
         BigNum num1;
@@ -150,13 +408,17 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Start is after end\n");
             return 5;
         }
-        if (num2 >= main->count) {
-            fprintf(stderr, "Number out of range (max %s)\n", main->count.hex().c_str());
+        if (num2 >= count) {
+            fprintf(stderr, "Number out of range (max %s)\n", count.hex().c_str());
             return 5;
         }
-        while (num1 < num2) {
-            printf("%s\n", Generate(graph, main, BigNum(num1)).c_str());
-            num1 += 1;
+        num2 -= num1;
+        if (threads > 1 || prefix) {
+            if (!PrintRangeParallel(graph, main, std::move(num1), std::move(num2), threads, chunksize, prefix)) {
+                return 6;
+            }
+        } else {
+            PrintRange(graph, main, std::move(num1), num2);
         }
         break;
     }
@@ -167,8 +429,8 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Cannot parse hex number '%s'\n", str);
             return 4;
         }
-        if (num >= main->count) {
-            fprintf(stderr, "Number out of range (max %s)\n", main->count.hex().c_str());
+        if (num >= count) {
+            fprintf(stderr, "Number out of range (max %s)\n", count.hex().c_str());
             return 5;
         }
         printf("%s\n", Generate(graph, main, std::move(num)).c_str());
@@ -184,51 +446,26 @@ int main(int argc, char** argv) {
         }
         break;
     }
+    case MODE_IMAGE:
+        if (!WriteFile(str, graph)) {
+            return 6;
+        }
+        break;
     case MODE_INFO:
     {
-        printf("Combinations: %s\n", main->count.hex().c_str());
-        printf("Bits: %g\n", main->count.log2());
-        printf("Nodes: %lu\n", (unsigned long)graph.nodes.size());
+        printf("Combinations: %s\n", count.hex().c_str());
+        printf("Bits: %g\n", count.log2());
+        printf("Nodes: %lu\n", (unsigned long)graph.size());
         break;
     }
     case MODE_ENCODE_STREAM:
-    {
-        char buf[8192];
-        while (fgets(buf, sizeof(buf), stdin) != nullptr) {
-            char* ptr = strchr(buf, '\n');
-            if (ptr) {
-                *ptr = 0;
-            }
-            BigNum num;
-            if (!num.set_hex(buf)) {
-                fprintf(stderr, "Cannot parse hex number '%s'\n", buf);
-                return 4;
-            }
-            if (num >= main->count) {
-                fprintf(stderr, "Number %s out of range (max %s)\n", num.hex().c_str(), main->count.hex().c_str());
-                return 5;
-            }
-            printf("%s\n", Generate(graph, main, BigNum(num)).c_str());
-        }
-        break;
-    }
+        return ProcessLines(stdin, stdout, [&](const char* line, size_t len, std::string& out, std::string& err) {
+            return EncodeLine(graph, main, line, len, out, err);
+        }, threads);
     case MODE_DECODE_STREAM:
-    {
-        char buf[8192];
-        while (fgets(buf, sizeof(buf), stdin) != nullptr) {
-            char* ptr = strchr(buf, '\n');
-            if (ptr) {
-                *ptr = 0;
-            }
-            BigNum num;
-            if (!Parse(graph, main, buf, num)) {
-                printf("-1\n");
-            } else {
-                printf("%s\n", num.hex().c_str());
-            }
-        }
-        break;
-    }
+        return ProcessLines(stdin, stdout, [&](const char* line, size_t len, std::string& out, std::string& err) {
+            return DecodeLine(graph, main, line, len, out, err);
+        }, threads, DECODE_CHUNK_SIZE);
     default:
         break;
     }
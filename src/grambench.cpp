@@ -0,0 +1,322 @@
+#include "interpreter.h"
+#include "enumerator.h"
+#include "import.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double Elapsed(const Clock::time_point& start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Produce a pseudorandom number below range, deterministically. */
+BigNum RandomBelow(std::mt19937& rng, const BigNum& range) {
+    std::vector<uint8_t> data((range.bits() + 7) / 8 + 8);
+    for (auto& x : data) {
+        x = rng();
+    }
+    BigNum num(data.data(), data.size());
+    num.divmod(range);
+    return num;
+}
+
+/* Split numbers below each CONCAT node's count into their digits, as Generate does, using
+ * precomputed divisors, the limb-wise division routine, and the bit-wise one. */
+void BenchDivmod(const char* name, const FlatGraph& graph) {
+    std::mt19937 rng(1);
+    std::vector<std::pair<uint32_t, BigNum>> samples;
+    std::vector<BigNum> counts;
+    for (uint32_t node = 0; node < graph.size(); node++) {
+        counts.push_back(graph.Count(node));
+        if (graph.types[node] == FlatGraph::NodeType::CONCAT) {
+            samples.emplace_back(node, RandomBelow(rng, counts.back()));
+        }
+    }
+    if (samples.empty()) {
+        return;
+    }
+
+    static const char* methods[3] = {"divisor", "limb", "bitwise"};
+    for (int method = 0; method < 3; method++) {
+        size_t ops = 0;
+        uint32_t check = 0;
+        auto start = Clock::now();
+        do {
+            for (const auto& sample : samples) {
+                BigNum num = sample.second;
+                uint32_t first = graph.firsts[sample.first];
+                for (uint32_t ref = first; ref < first + graph.nums[sample.first]; ref++) {
+                    uint32_t sub = graph.refnodes[ref];
+                    BigNum quot = method == 0 ? num.divmod(graph.GetDivisor(sub)) : method == 1 ? num.divmod(counts[sub]) : num.divmod_bitwise(counts[sub]);
+                    check += num.get_ui();
+                    num = std::move(quot);
+                    ops++;
+                }
+            }
+        } while (Elapsed(start) < 0.5);
+        double secs = Elapsed(start);
+        printf("%s: divmod_%s %.1f ns/op (%lu ops, check %08x)\n", name, methods[method], secs * 1e9 / ops, (unsigned long)ops, (unsigned)check);
+    }
+}
+
+/* Generate and parse phrases for random numbers below the root's count, with the recursive
+ * reference implementation and the explicit-stack Evaluator. */
+void BenchEvaluate(const char* name, const FlatGraph& graph) {
+    static const size_t SAMPLES = 1000;
+    std::mt19937 rng(1);
+    uint32_t root = graph.root();
+    BigNum count = graph.Count(root);
+    std::vector<BigNum> nums;
+    std::vector<std::string> phrases;
+    for (size_t i = 0; i < SAMPLES; i++) {
+        nums.push_back(RandomBelow(rng, count));
+        phrases.push_back(Generate(graph, root, BigNum(nums.back())));
+    }
+
+    static const char* methods[2] = {"recursive", "stack"};
+    Evaluator evaluator;
+    std::vector<char> buf(graph.maxlens[root]);
+    std::string out;
+    for (int method = 0; method < 2; method++) {
+        size_t ops = 0;
+        uint32_t check = 0;
+        auto start = Clock::now();
+        do {
+            for (const auto& num : nums) {
+                if (method == 0) {
+                    out.clear();
+                    GenerateRecursive(graph, root, BigNum(num), out);
+                    check += out.size() + out[0];
+                } else {
+                    size_t len = evaluator.Generate(graph, root, BigNum(num), buf.data());
+                    check += len + buf[0];
+                }
+                ops++;
+            }
+        } while (Elapsed(start) < 0.5);
+        double secs = Elapsed(start);
+        printf("%s: generate_%s %.1f ns/op (%lu ops, check %08x)\n", name, methods[method], secs * 1e9 / ops, (unsigned long)ops, (unsigned)check);
+    }
+    for (int method = 0; method < 2; method++) {
+        size_t ops = 0;
+        uint32_t check = 0;
+        auto start = Clock::now();
+        BigNum num;
+        do {
+            for (const auto& phrase : phrases) {
+                bool ok = method == 0 ? ParseRecursive(graph, root, phrase.data(), phrase.size(), num) : evaluator.Parse(graph, root, phrase.data(), phrase.size(), num);
+                check += ok + num.get_ui();
+                ops++;
+            }
+        } while (Elapsed(start) < 0.5);
+        double secs = Elapsed(start);
+        printf("%s: parse_%s %.1f ns/op (%lu ops, check %08x)\n", name, methods[method], secs * 1e9 / ops, (unsigned long)ops, (unsigned)check);
+    }
+}
+
+/* Look up every word of every dictionary, and as many words that are not in them (each word with
+ * one byte changed), with find (a perfect hash if the file has one, otherwise the prefix search)
+ * and the plain binary search. */
+void BenchDicts(const char* name, const FlatGraph& graph) {
+    std::mt19937 rng(1);
+    std::vector<std::pair<const Strings*, std::string>> queries;
+    for (const auto& dict : graph.dicts) {
+        for (size_t i = 0; dict.length() > 0 && i < dict.size(); i++) {
+            std::string word = dict[i];
+            queries.emplace_back(&dict, word);
+            word[rng() % word.size()] ^= 1 + rng() % 127;
+            queries.emplace_back(&dict, word);
+        }
+    }
+    std::shuffle(queries.begin(), queries.end(), rng);
+    if (queries.empty()) {
+        return;
+    }
+
+    static const char* methods[2] = {"find", "bsearch"};
+    for (int method = 0; method < 2; method++) {
+        size_t ops = 0;
+        uint32_t check = 0;
+        auto start = Clock::now();
+        do {
+            for (const auto& query : queries) {
+                const std::string& word = query.second;
+                int ret = method == 0 ? query.first->find(word.data(), word.size()) : query.first->find_bsearch(word.data(), word.size());
+                check += ret;
+                ops++;
+            }
+        } while (Elapsed(start) < 0.5);
+        double secs = Elapsed(start);
+        printf("%s: dict_%s %.1f ns/op (%lu ops, check %08x)\n", name, methods[method], secs * 1e9 / ops, (unsigned long)ops, (unsigned)check);
+    }
+}
+
+/* Time loading the file with Import. */
+void BenchImport(const char* name, const char* file) {
+    size_t ops = 0;
+    size_t check = 0;
+    auto start = Clock::now();
+    do {
+        FILE* fp = fopen(file, "r");
+        if (!fp) {
+            return;
+        }
+        FlatGraph graph;
+        Import(graph, fp);
+        fclose(fp);
+        check += graph.size();
+        ops++;
+    } while (Elapsed(start) < 0.5);
+    double secs = Elapsed(start);
+    printf("%s: import %.3f ms/op (%lu ops, check %08x)\n", name, secs * 1e3 / ops, (unsigned long)ops, (unsigned)check);
+}
+
+/* Time loading the file as an image, written to a temporary file first. */
+void BenchLoadImage(const char* name, const FlatGraph& graph) {
+    char path[] = "/tmp/grambench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return;
+    }
+    FILE* fp = fdopen(fd, "w");
+    WriteImage(graph, fp);
+    fclose(fp);
+    size_t ops = 0;
+    size_t check = 0;
+    auto start = Clock::now();
+    do {
+        FlatGraph loaded;
+        if (!LoadImage(loaded, path)) {
+            break;
+        }
+        check += loaded.size();
+        ops++;
+    } while (Elapsed(start) < 0.5);
+    double secs = Elapsed(start);
+    unlink(path);
+    if (ops > 0) {
+        printf("%s: load_image %.3f ms/op (%lu ops, check %08x)\n", name, secs * 1e3 / ops, (unsigned long)ops, (unsigned)check);
+    }
+}
+
+/* Phrases per second for what gram does per line: generating from a random number, encoding a
+ * hexadecimal number, decoding a phrase into one, and enumerating consecutive phrases. Also
+ * encoding the same numbers at once with GenerateBatch. */
+void BenchRates(const char* name, const FlatGraph& graph) {
+    static const size_t SAMPLES = 1000;
+    std::mt19937 rng(1);
+    uint32_t root = graph.root();
+    BigNum count = graph.Count(root);
+    std::vector<std::string> hexes;
+    std::vector<std::string> phrases;
+    for (size_t i = 0; i < SAMPLES; i++) {
+        BigNum num = RandomBelow(rng, count);
+        hexes.push_back(num.hex());
+        phrases.push_back(Generate(graph, root, std::move(num)));
+    }
+
+    static const char* methods[5] = {"generate", "encode", "decode", "enumerate", "encode_batch"};
+    std::string out;
+    std::vector<BigNum> nums;
+    std::vector<size_t> ends;
+    for (int method = 0; method < 5; method++) {
+        size_t ops = 0;
+        uint32_t check = 0;
+        auto start = Clock::now();
+        do {
+            out.clear();
+            if (method == 0) {
+                for (size_t i = 0; i < SAMPLES; i++) {
+                    Generate(graph, root, RandomBelow(rng, count), out);
+                    out += '\n';
+                }
+            } else if (method == 1) {
+                for (const auto& hex : hexes) {
+                    BigNum num;
+                    num.set_hex(hex);
+                    Generate(graph, root, std::move(num), out);
+                    out += '\n';
+                }
+            } else if (method == 2) {
+                BigNum num;
+                for (const auto& phrase : phrases) {
+                    Parse(graph, root, phrase.data(), phrase.size(), num);
+                    num.hex(out);
+                    out += '\n';
+                }
+            } else if (method == 4) {
+                nums.resize(SAMPLES);
+                for (size_t i = 0; i < SAMPLES; i++) {
+                    nums[i].set_hex(hexes[i]);
+                }
+                GenerateBatch(graph, root, nums, out, ends);
+            } else {
+                Enumerator enumerator(graph, root, RandomBelow(rng, count));
+                for (size_t i = 0; i < SAMPLES; i++) {
+                    out.append(enumerator.data(), enumerator.size());
+                    out += '\n';
+                    enumerator.Next();
+                }
+            }
+            check += out.size();
+            ops += SAMPLES;
+        } while (Elapsed(start) < 0.5);
+        double secs = Elapsed(start);
+        printf("%s: %s %.0f phrases/s (%lu ops, check %08x)\n", name, methods[method], ops / secs, (unsigned long)ops, (unsigned)check);
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    bool rates = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            rates = true;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-r] file...\n", *argv);
+        fprintf(stderr, "  -r: only measure import and image load time and phrase rates, not the internal alternatives\n");
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        FILE* fp = fopen(argv[i], "r");
+        if (!fp) {
+            fprintf(stderr, "Unable to open file '%s'\n", argv[i]);
+            return 2;
+        }
+        FlatGraph graph;
+        Import(graph, fp);
+        fclose(fp);
+        if (graph.size() == 0) {
+            fprintf(stderr, "Invalid translation file '%s'\n", argv[i]);
+            return 2;
+        }
+        const char* name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+        if (!rates) {
+            BenchDivmod(name, graph);
+            BenchEvaluate(name, graph);
+            BenchDicts(name, graph);
+        }
+        BenchImport(name, argv[i]);
+        BenchLoadImage(name, graph);
+        BenchRates(name, graph);
+    }
+    return 0;
+}
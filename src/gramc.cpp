@@ -3,19 +3,119 @@
 #include "expgraph.h"
 #include "expander.h"
 #include "export.h"
+#include "import.h"
+#include "codegen.h"
 #include <unistd.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <chrono>
 
 namespace {
 
-ExpGraph::Ref ExpandForBits(const Graph::Ref& main, ExpGraph& expgraph, double minbits, double overshoot, size_t minlen, size_t maxlen, size_t maxnodes, size_t maxthunks) {
-    Expander exp(&expgraph, maxnodes, maxthunks);
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(const Clock::time_point& start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Timings and counters of the compilation stages, written as JSON with -P. */
+struct Profile {
+    struct Expansion {
+        size_t len;
+        double seconds;
+        size_t thunks; // Totals after this expansion; the Expander keeps them across lengths.
+        size_t nodes;
+        double bits; // Negative if there are no phrases of this length.
+        std::string error;
+    };
+
+    std::vector<std::pair<std::string, double>> stages;
+    std::vector<Expansion> expansions;
+    Expander::Stats stats;
+
+    void AddExpansion(const Expander& exp, const ExpGraph& expgraph, size_t len, double seconds, const std::pair<ExpGraph::Ref, std::string>& result) {
+        Expansion expansion = {len, seconds, exp.Thunks(), expgraph.nodes.size(), result.first ? result.first->count.log2() : -1.0, result.second};
+        expansions.push_back(std::move(expansion));
+        stats = exp.GetStats();
+    }
+
+    bool Write(const char* file, const char* infile) const;
+};
+
+std::string JsonString(const std::string& str) {
+    std::string ret = "\"";
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            ret += buf;
+        } else {
+            ret += c;
+        }
+    }
+    return ret + "\"";
+}
+
+void WriteMemo(FILE* fp, const char* name, uint64_t lookups, uint64_t hits, bool last) {
+    fprintf(fp, "    \"%s\": {\"lookups\": %llu, \"hits\": %llu, \"hit_rate\": %.6f}%s\n", name, (unsigned long long)lookups, (unsigned long long)hits, lookups ? (double)hits / lookups : 0.0, last ? "" : ",");
+}
+
+bool Profile::Write(const char* file, const char* infile) const {
+    FILE* fp = fopen(file, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file '%s'\n", file);
+        return false;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"input\": %s,\n", JsonString(infile).c_str());
+    fprintf(fp, "  \"stages\": [\n");
+    for (size_t i = 0; i < stages.size(); i++) {
+        fprintf(fp, "    {\"name\": %s, \"seconds\": %.6f}%s\n", JsonString(stages[i].first).c_str(), stages[i].second, i + 1 < stages.size() ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"expansions\": [\n");
+    for (size_t i = 0; i < expansions.size(); i++) {
+        const Expansion& e = expansions[i];
+        fprintf(fp, "    {\"len\": %lu, \"seconds\": %.6f, \"thunks\": %lu, \"nodes\": %lu, ", (unsigned long)e.len, e.seconds, (unsigned long)e.thunks, (unsigned long)e.nodes);
+        if (e.bits >= 0) {
+            fprintf(fp, "\"bits\": %.4f", e.bits);
+        } else {
+            fprintf(fp, "\"bits\": null");
+        }
+        if (e.error.size()) {
+            fprintf(fp, ", \"error\": %s", JsonString(e.error).c_str());
+        }
+        fprintf(fp, "}%s\n", i + 1 < expansions.size() ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"memo\": {\n");
+    WriteMemo(fp, "thunkmap", stats.thunk_lookups, stats.thunk_hits, false);
+    WriteMemo(fp, "dictmap", stats.dict_lookups, stats.dict_hits, false);
+    WriteMemo(fp, "nodemap", stats.node_lookups, stats.node_hits, false);
+    WriteMemo(fp, "cache", stats.cache_lookups, stats.cache_hits, true);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"peak_rss_kb\": %ld\n", (long)usage.ru_maxrss);
+    fprintf(fp, "}\n");
+    fclose(fp);
+    return true;
+}
+
+ExpGraph::Ref ExpandForBits(const Graph::Ref& main, Expander& exp, ExpGraph& expgraph, double minbits, double overshoot, size_t minlen, size_t maxlen, Profile* profile) {
     double goalbits = minbits + log1p(overshoot) / log(2.0);
 
     std::vector<ExpGraph::Ref> refs;
     BigNum total;
     for (size_t len = minlen; len <= maxlen; len++) {
+        Clock::time_point start = Clock::now();
         auto r = exp.Expand(main, len);
+        if (profile) {
+            profile->AddExpansion(exp, expgraph, len, Seconds(start), r);
+        }
         if (r.second.size() > 0) {
             fprintf(stderr, "Expansion failure: %s\n", r.second.c_str());
             return ExpGraph::Ref();
@@ -46,13 +146,15 @@ ExpGraph::Ref ExpandForBits(const Graph::Ref& main, ExpGraph& expgraph, double m
     return ExpGraph::Ref();
 }
 
-ExpGraph::Ref ExpandForMax(const Graph::Ref& main, ExpGraph& expgraph, double maxbits, size_t minlen, size_t maxlen, size_t maxnodes, size_t maxthunks) {
-    Expander exp(&expgraph, maxnodes, maxthunks);
-
+ExpGraph::Ref ExpandForMax(const Graph::Ref& main, Expander& exp, ExpGraph& expgraph, double maxbits, size_t minlen, size_t maxlen, Profile* profile) {
     std::vector<ExpGraph::Ref> refs;
     BigNum total;
     for (size_t len = minlen; len <= maxlen; len++) {
+        Clock::time_point start = Clock::now();
         auto r = exp.Expand(main, len);
+        if (profile) {
+            profile->AddExpansion(exp, expgraph, len, Seconds(start), r);
+        }
         if (r.second.size() > 0) {
             break;
         }
@@ -71,17 +173,56 @@ ExpGraph::Ref ExpandForMax(const Graph::Ref& main, ExpGraph& expgraph, double ma
     return expgraph.NewDisjunct(std::move(refs));
 }
 
-bool WriteFile(const char *file, ExpGraph& expgraph, const ExpGraph::Ref& emain) {
+bool WriteFile(const char *file, ExpGraph& expgraph, const ExpGraph::Ref& emain, bool hashes) {
+    FILE* fp = fopen(file, "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file '%s'\n", file);
+        return false;
+    }
+    Export(expgraph, emain, fp, hashes);
+    fclose(fp);
+    return true;
+}
+
+/* Graphs with more nodes than this are warned about when writing C++ source. */
+static const size_t SOURCE_LARGE_NODES = 5000;
+
+/* Write C++ source specialized to the result. It is made from the translation file for it, read
+ * back, so that it numbers phrases exactly like that file does. */
+bool WriteSourceFile(const char *file, ExpGraph& expgraph, const ExpGraph::Ref& emain, const char* name) {
+    FILE* tmp = tmpfile();
+    if (!tmp) {
+        fprintf(stderr, "Unable to create temporary file\n");
+        return false;
+    }
+    Export(expgraph, emain, tmp, false);
+    rewind(tmp);
+    FlatGraph graph;
+    Import(graph, tmp);
+    fclose(tmp);
     FILE* fp = fopen(file, "w");
     if (!fp) {
         fprintf(stderr, "Unable to open file '%s'\n", file);
         return false;
     }
-    Export(expgraph, emain, fp);
+    if (graph.size() > SOURCE_LARGE_NODES) {
+        fprintf(stderr, "Warning: %lu nodes give a large header that is slow to compile (see src/codegen.h)\n", (unsigned long)graph.size());
+    }
+    WriteSource(graph, name, fp);
     fclose(fp);
     return true;
 }
 
+bool ValidName(const char* name) {
+    for (const char* c = name; *c; c++) {
+        bool alpha = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_';
+        if (!alpha && (c == name || *c < '0' || *c > '9')) {
+            return false;
+        }
+    }
+    return *name != 0;
+}
+
 Graph::Ref ParseFile(const char *file, Graph& graph) {
     FILE* fp = fopen(file, "r");
     if (!fp) {
@@ -114,6 +255,80 @@ Graph::Ref ParseFile(const char *file, Graph& graph) {
     return main;
 }
 
+/* Run all compilation stages, timing them in profile if set. Returns the exit code. */
+int Compile(const char* infile, const char* outfile, const char* cachefile, char mode, double bits, double overshoot, size_t minlen, size_t maxlen, size_t maxnodes, size_t maxthunks, int threads, bool hashes, const char* source, Profile* profile) {
+    Clock::time_point start = Clock::now();
+    auto stage = [&](const char* name) {
+        if (profile) {
+            profile->stages.emplace_back(name, Seconds(start));
+        }
+        start = Clock::now();
+    };
+
+    Graph graph;
+    Graph::Ref main = ParseFile(infile, graph);
+    if (!main) {
+        return 1;
+    }
+    stage("parse");
+
+    Optimize(graph);
+    OptimizeRef(graph, main);
+    stage("optimize_graph");
+
+    ExpansionCache cache;
+    size_t cached = 0;
+    if (cachefile) {
+        if (!cache.Load(cachefile)) {
+            return 3;
+        }
+        cached = cache.Entries();
+        stage("load_cache");
+    }
+
+    ThreadPool pool(threads);
+    ExpGraph expgraph;
+    ExpGraph::Ref emain;
+    {
+        // The Expander holds on to the nodes it made, so it must be gone before optimizing.
+        Expander exp(&expgraph, maxnodes, maxthunks, &pool, cachefile ? &cache : nullptr);
+        if (mode == 0 || mode == 'b') {
+            emain = ExpandForBits(main, exp, expgraph, bits, overshoot, minlen, maxlen, profile);
+        } else {
+            emain = ExpandForMax(main, exp, expgraph, bits, minlen, maxlen, profile);
+        }
+        stage("expand");
+        if (cachefile) {
+            exp.StoreInCache();
+        }
+    }
+    if (cachefile && cache.Entries() != cached) {
+        // Failing to update the cache only makes the next run slower.
+        cache.Save(cachefile);
+        stage("save_cache");
+    }
+    if (!emain.defined()) {
+        return 2;
+    }
+    main = Graph::Ref();
+
+    Optimize(expgraph);
+    stage("optimize_expgraph");
+
+    printf("Result: %s combinations (%g bits)\n", emain->count.hex().c_str(), emain->count.log2());
+
+    if (source) {
+        WriteSourceFile(outfile, expgraph, emain, source);
+        stage("codegen");
+    } else {
+        WriteFile(outfile, expgraph, emain, hashes);
+        stage("export");
+    }
+
+    emain = ExpGraph::Ref();
+    return 0;
+}
+
 }
 
 int main(int argc, char** argv) {
@@ -122,15 +337,20 @@ int main(int argc, char** argv) {
     size_t maxnodes = 1000000;
     size_t maxthunks = 250000;
     double overshoot = 0.2;
+    int threads = 1;
     char mode = 0;
     double bits = 64;
     const char* infile = nullptr;
     const char* outfile = nullptr;
+    const char* proffile = nullptr;
+    const char* cachefile = nullptr;
+    bool hashes = false;
+    const char* source = nullptr;
     bool invalid_usage = false;
     bool help = false;
 
     int opt;
-    while ((opt = getopt(argc, argv, "b:B:l:u:N:T:O:h")) != -1) {
+    while ((opt = getopt(argc, argv, "b:B:l:u:N:T:O:j:P:C:HX:h")) != -1) {
         switch (opt) {
         case 'b':
         case 'B':
@@ -156,6 +376,25 @@ int main(int argc, char** argv) {
         case 'O':
             overshoot = strtod(optarg, nullptr);
             break;
+        case 'j': {
+            char* end;
+            long val = strtol(optarg, &end, 10);
+            // Check before narrowing to int; anything invalid becomes 0, which is rejected below.
+            threads = (*optarg && *end == 0 && val >= 1 && val <= 1024) ? (int)val : 0;
+            break;
+        }
+        case 'P':
+            proffile = optarg;
+            break;
+        case 'C':
+            cachefile = optarg;
+            break;
+        case 'H':
+            hashes = true;
+            break;
+        case 'X':
+            source = optarg;
+            break;
         case 'h':
             help = true;
         }
@@ -191,6 +430,16 @@ int main(int argc, char** argv) {
         invalid_usage = true;
     }
 
+    if (!help && (threads < 1 || threads > 1024)) {
+        fprintf(stderr, "Threads out of range (1-1024)\n");
+        invalid_usage = true;
+    }
+
+    if (!help && source && !ValidName(source)) {
+        fprintf(stderr, "Namespace name must be a C++ identifier\n");
+        invalid_usage = true;
+    }
+
     if (!help && optind + 1 > argc) {
         fprintf(stderr, "Expected input filename\n");
         invalid_usage = true;
@@ -218,6 +467,12 @@ int main(int argc, char** argv) {
         fprintf(stderr, "  -B bits: find a large range with at most bits bits of entropy (default: unset)\n");
         fprintf(stderr, "  -l minlen: generate phrases of at least minlen characters (default: 0)\n");
         fprintf(stderr, "  -u maxlen: generate phrases of at most maxlen characters (default: 1024)\n");
+        fprintf(stderr, "  -j threads: use threads threads for expansion (default: 1)\n");
+        fprintf(stderr, "  -H: include perfect hashes of the dictionaries in the output, for faster decoding\n");
+        fprintf(stderr, "  -X name: write a C++ header with Generate and Parse specialized to the result, in\n");
+        fprintf(stderr, "           namespace name, instead of a translation file (see src/codegen.h)\n");
+        fprintf(stderr, "  -C file: keep expansion results in cache file, to reuse them in later runs\n");
+        fprintf(stderr, "  -P file: write timings and counters of the compilation stages to file, as JSON\n");
         fprintf(stderr, "  -N maxnodes, -T maxthunks, -O overshoot: miscelleanous tweaks\n");
         if (invalid_usage) {
             return -1;
@@ -226,30 +481,11 @@ int main(int argc, char** argv) {
     }
 
 
-    Graph graph;
-    Graph::Ref main = ParseFile(infile, graph);
-    if (!main) {
-        return 1;
-    }
-
-    ExpGraph expgraph;
-    ExpGraph::Ref emain;
-    if (mode == 0 || mode == 'b') {
-        emain = ExpandForBits(main, expgraph, bits, overshoot, minlen, maxlen, maxnodes, maxthunks);
-    } else {
-        emain = ExpandForMax(main, expgraph, bits, minlen, maxlen, maxnodes, maxthunks);
+    Profile profile;
+    Profile* prof = proffile ? &profile : nullptr;
+    int ret = Compile(infile, outfile, cachefile, mode, bits, overshoot, minlen, maxlen, maxnodes, maxthunks, threads, hashes, source, prof);
+    if (prof && !profile.Write(proffile, infile)) {
+        return ret ? ret : 3;
     }
-    if (!emain.defined()) {
-        return 2;
-    }
-    main = Graph::Ref();
-
-    Optimize(expgraph);
-
-    printf("Result: %s combinations (%g bits)\n", emain->count.hex().c_str(), emain->count.log2());
-
-    WriteFile(outfile, expgraph, emain);
-
-    emain = ExpGraph::Ref();
-    return 0;
+    return ret;
 }
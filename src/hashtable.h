@@ -0,0 +1,108 @@
+#ifndef _GRAMTROPY_HASHTABLE_H_
+#define _GRAMTROPY_HASHTABLE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Mix value into a running hash. */
+inline uint64_t HashCombine(uint64_t seed, uint64_t value) {
+    seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    seed ^= seed >> 31;
+    seed *= 0xbf58476d1ce4e5b9ULL;
+    return seed ^ (seed >> 29);
+}
+
+/* Mix the length and bytes of str into a running hash. Unlike std::hash, the result is the same
+ * on every platform and standard library. */
+inline uint64_t HashString(uint64_t seed, const std::string& str) {
+    seed = HashCombine(seed, str.size());
+    for (size_t i = 0; i < str.size(); i += 8) {
+        uint64_t word = 0;
+        for (size_t j = i; j < i + 8 && j < str.size(); j++) {
+            word = (word << 8) | (unsigned char)str[j];
+        }
+        seed = HashCombine(seed, word);
+    }
+    return seed;
+}
+
+/* An insert-only open addressing hash table with linear probing. The table does not know how
+ * to hash or compare entries itself: callers pass the hash of what they look for, and a
+ * predicate that tells whether a stored entry matches. */
+template <typename T>
+class HashTable {
+    struct Slot {
+        uint64_t hash; // 0 marks an empty slot.
+        T value;
+
+        Slot() : hash(0) {}
+    };
+
+    std::vector<Slot> slots;
+    size_t used;
+
+    static uint64_t Stored(uint64_t hash) { return hash ? hash : 1; }
+
+    void Grow() {
+        std::vector<Slot> old(slots.empty() ? 16 : slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (Slot& slot : old) {
+            if (slot.hash) {
+                size_t pos = slot.hash & mask;
+                while (slots[pos].hash) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos].hash = slot.hash;
+                slots[pos].value = std::move(slot.value);
+            }
+        }
+    }
+
+public:
+    HashTable() : used(0) {}
+
+    size_t size() const { return used; }
+
+    /* Return the entry with the given hash for which match returns true, or nullptr. */
+    template <typename Match>
+    const T* find(uint64_t hash, Match match) const {
+        if (slots.empty()) {
+            return nullptr;
+        }
+        hash = Stored(hash);
+        size_t mask = slots.size() - 1;
+        for (size_t pos = hash & mask; slots[pos].hash; pos = (pos + 1) & mask) {
+            if (slots[pos].hash == hash && match(slots[pos].value)) {
+                return &slots[pos].value;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Add an entry, which must not match any existing one. */
+    void insert(uint64_t hash, T&& value) {
+        if (2 * (used + 1) > slots.size()) {
+            Grow();
+        }
+        hash = Stored(hash);
+        size_t mask = slots.size() - 1;
+        size_t pos = hash & mask;
+        while (slots[pos].hash) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].hash = hash;
+        slots[pos].value = std::move(value);
+        used++;
+    }
+
+    void clear() {
+        slots.clear();
+        used = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "image.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char IMAGE_MAGIC[8] = {'G', 'T', 'P', 'I', 'M', 'G', 0, 2};
+
+namespace {
+
+static const size_t HEADER_SIZE = 32;
+static const size_t DICT_SIZE = 48;
+
+static_assert(sizeof(CharSet) == 32, "CharSet is stored as 4 uint64s");
+
+uint32_t ReadLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t ReadLE64(const uint8_t* p) {
+    return ReadLE32(p) | ((uint64_t)ReadLE32(p + 4) << 32);
+}
+
+template<typename I>
+void WriteLE(std::vector<uint8_t>& out, I v) {
+    for (size_t i = 0; i < sizeof(I); i++) {
+        out.push_back((uint64_t)v >> (8 * i));
+    }
+}
+
+void WriteLE(std::vector<uint8_t>& out, const CharSet& v) {
+    for (uint64_t bits : v.bits) {
+        WriteLE(out, bits);
+    }
+}
+
+size_t Align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+/* Append arr in little endian, padded to a multiple of 8 bytes. */
+template<typename T>
+void WriteArray(std::vector<uint8_t>& out, const FlatArray<T>& arr) {
+    for (const T& v : arr) {
+        WriteLE(out, v);
+    }
+    out.resize(Align8(out.size()));
+}
+
+/* Hands out the arrays of a mapped image, checking that they lie within it. */
+class ImageReader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+
+public:
+    ImageReader(const uint8_t* data_, size_t size_, size_t pos_) : data(data_), size(size_), pos(pos_) {}
+
+    /* Return the bytes at offset, or null if they are not within the image or offset is not
+     * 8-byte aligned. */
+    const uint8_t* At(uint64_t offset, uint64_t len) const {
+        if ((offset & 7) != 0 || offset > size || len > size - offset) {
+            return nullptr;
+        }
+        return data + offset;
+    }
+
+    /* Return the next len bytes, or null if they are not within the image. The next array starts
+     * at the following multiple of 8 bytes. */
+    const uint8_t* Next(uint64_t len) {
+        const uint8_t* ret = At(pos, len);
+        pos = Align8(pos + len);
+        return ret;
+    }
+
+    /* Point arr at the next n elements. */
+    template<typename T>
+    bool Read(FlatArray<T>& arr, uint64_t n) {
+        const uint8_t* ptr = Next(n * sizeof(T));
+        if (!ptr) {
+            return false;
+        }
+        arr = FlatArray<T>(reinterpret_cast<const T*>(ptr), n);
+        return true;
+    }
+};
+
+/* Whether div holds the normalized limbs, shift and reciprocal that Divisor computes for the
+ * non-zero number div.value. */
+bool CheckDivisor(const DivisorRef& div) {
+    unsigned int n = div.value.len;
+    if (n == 0 || div.value.limbs[n - 1] == 0 || div.shift >= 32) {
+        return false;
+    }
+    int s = div.shift;
+    for (unsigned int k = 0; k < n; k++) {
+        uint32_t limb = div.value.limbs[k] << s;
+        if (k > 0 && s > 0) {
+            limb |= div.value.limbs[k - 1] >> (32 - s);
+        }
+        if (div.norm[k] != limb) {
+            return false;
+        }
+    }
+    uint32_t d = div.norm[n - 1];
+    return (d & 0x80000000) && (d >> s) == div.value.limbs[n - 1] && div.inv == ((((uint64_t)~d) << 32) | 0xFFFFFFFF) / d;
+}
+
+/* Check that the arrays of a loaded image agree with each other: every index and position is in
+ * range, every node's length, longest length and count are what AddDict and AddNode compute from
+ * its dictionary or refs, and the DISJUNCT offsets and divisors match the counts. Otherwise a
+ * damaged file could make Generate or Parse access memory out of bounds. This reads the arrays
+ * once, and for counts of up to 512 bits does not allocate. */
+bool CheckGraph(const FlatGraph& graph) {
+    size_t nnodes = graph.size();
+    size_t nrefs = graph.refnodes.size();
+    if (nnodes == 0 || graph.countstarts[0] != 0 || graph.countstarts[nnodes] != graph.limbs.size() || graph.offsetstarts[0] != 0 || graph.offsetstarts[nrefs] != graph.offsetlimbs.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < nnodes; i++) {
+        if (graph.countstarts[i + 1] < graph.countstarts[i]) {
+            return false;
+        }
+    }
+    for (size_t j = 0; j < nrefs; j++) {
+        if (graph.offsetstarts[j + 1] < graph.offsetstarts[j]) {
+            return false;
+        }
+    }
+    BigNum count;
+    for (uint32_t i = 0; i < nnodes; i++) {
+        uint32_t first = graph.firsts[i];
+        uint32_t num = graph.nums[i];
+        int len = graph.lens[i];
+        uint32_t maxlen = 0;
+        if (graph.types[i] == FlatGraph::NodeType::DICT) {
+            if (first >= graph.dicts.size() || num != 0) {
+                return false;
+            }
+            const Strings& dict = graph.dicts[first];
+            len = dict.length();
+            maxlen = len;
+            count = BigNum(dict.size());
+        } else if (graph.types[i] == FlatGraph::NodeType::CONCAT) {
+            if (num < 2 || (uint64_t)first + num > nrefs || len < 0) {
+                return false;
+            }
+            int64_t sum = 0;
+            count = 1;
+            for (uint32_t j = first; j < first + num; j++) {
+                uint32_t sub = graph.refnodes[j];
+                if (sub >= i || graph.lens[sub] < 0 || (uint64_t)graph.refpos[j] + graph.lens[sub] > (uint64_t)len || graph.Offset(j).len != 0) {
+                    return false;
+                }
+                sum += graph.lens[sub];
+                count *= graph.CountRef(sub);
+            }
+            if (sum != len) {
+                return false;
+            }
+            maxlen = len;
+        } else if (graph.types[i] == FlatGraph::NodeType::DISJUNCT) {
+            if (num < 2 || (uint64_t)first + num > nrefs) {
+                return false;
+            }
+            count = 0;
+            for (uint32_t j = first; j < first + num; j++) {
+                uint32_t sub = graph.refnodes[j];
+                if (sub >= i || graph.refpos[j] != 0 || count.compare(graph.Offset(j)) != 0) {
+                    return false;
+                }
+                count += graph.CountRef(sub);
+                if (j == first) {
+                    len = graph.lens[sub];
+                } else if (len != graph.lens[sub]) {
+                    len = -1;
+                }
+                maxlen = std::max(maxlen, graph.maxlens[sub]);
+            }
+        } else {
+            return false;
+        }
+        if (graph.lens[i] != len || graph.maxlens[i] != maxlen || count.compare(graph.CountRef(i)) != 0 || !CheckDivisor(graph.GetDivisor(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+void WriteImage(const FlatGraph& graph, FILE* file) {
+    std::vector<uint8_t> out(IMAGE_MAGIC, IMAGE_MAGIC + sizeof(IMAGE_MAGIC));
+    WriteLE<uint32_t>(out, graph.size());
+    WriteLE<uint32_t>(out, graph.refnodes.size());
+    WriteLE<uint32_t>(out, graph.limbs.size());
+    WriteLE<uint32_t>(out, graph.offsetlimbs.size());
+    WriteLE<uint32_t>(out, graph.dicts.size());
+    WriteLE<uint32_t>(out, 0);
+    WriteArray(out, graph.types);
+    WriteArray(out, graph.lens);
+    WriteArray(out, graph.maxlens);
+    WriteArray(out, graph.firsts);
+    WriteArray(out, graph.nums);
+    WriteArray(out, graph.countstarts);
+    WriteArray(out, graph.shifts);
+    WriteArray(out, graph.invs);
+    WriteArray(out, graph.firstchars);
+    WriteArray(out, graph.lastchars);
+    WriteArray(out, graph.refpos);
+    WriteArray(out, graph.refnodes);
+    WriteArray(out, graph.offsetstarts);
+    WriteArray(out, graph.limbs);
+    WriteArray(out, graph.norms);
+    WriteArray(out, graph.offsetlimbs);
+
+    // The dictionary data follows the table, in the order the table lists it.
+    uint64_t pos = out.size() + graph.dicts.size() * DICT_SIZE;
+    for (const Strings& dict : graph.dicts) {
+        WriteLE<uint32_t>(out, dict.length());
+        WriteLE<uint32_t>(out, dict.size());
+        WriteLE<uint32_t>(out, dict.HasPerfectHash());
+        WriteLE<uint32_t>(out, 0);
+        WriteLE<uint64_t>(out, pos);
+        pos += Align8(dict.length() * dict.size());
+        WriteLE<uint64_t>(out, pos);
+        pos += dict.size() * 8;
+        WriteLE<uint64_t>(out, dict.HasPerfectHash() ? pos : 0);
+        pos += Align8(dict.Slots().size() * 4);
+        WriteLE<uint64_t>(out, dict.HasPerfectHash() ? pos : 0);
+        pos += Align8(dict.Seeds().size() * 4);
+    }
+    fwrite(out.data(), 1, out.size(), file);
+
+    static const char zero[8] = {0};
+    for (const Strings& dict : graph.dicts) {
+        size_t size = dict.length() * dict.size();
+        fwrite(dict.StringBegin(0), 1, size, file);
+        fwrite(zero, 1, Align8(size) - size, file);
+        out.clear();
+        WriteArray(out, dict.Prefixes());
+        WriteArray(out, dict.Slots());
+        WriteArray(out, dict.Seeds());
+        fwrite(out.data(), 1, out.size(), file);
+    }
+}
+
+bool LoadImage(FlatGraph& graph, const char* filename) {
+    // The arrays are used as stored, in little endian.
+    const uint32_t one = 1;
+    if (*reinterpret_cast<const uint8_t*>(&one) != 1) {
+        return false;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    std::shared_ptr<const void> storage(map, [size](const void* ptr) { munmap(const_cast<void*>(ptr), size); });
+    const uint8_t* data = static_cast<const uint8_t*>(map);
+
+    if (memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        return false;
+    }
+    uint64_t nnodes = ReadLE32(data + 8);
+    uint64_t nrefs = ReadLE32(data + 12);
+    uint64_t nlimbs = ReadLE32(data + 16);
+    uint64_t noffsetlimbs = ReadLE32(data + 20);
+    uint64_t ndicts = ReadLE32(data + 24);
+
+    FlatGraph loaded;
+    ImageReader reader(data, size, HEADER_SIZE);
+    if (!reader.Read(loaded.types, nnodes) || !reader.Read(loaded.lens, nnodes) || !reader.Read(loaded.maxlens, nnodes) ||
+        !reader.Read(loaded.firsts, nnodes) || !reader.Read(loaded.nums, nnodes) || !reader.Read(loaded.countstarts, nnodes + 1) ||
+        !reader.Read(loaded.shifts, nnodes) || !reader.Read(loaded.invs, nnodes) || !reader.Read(loaded.firstchars, nnodes) ||
+        !reader.Read(loaded.lastchars, nnodes) || !reader.Read(loaded.refpos, nrefs) || !reader.Read(loaded.refnodes, nrefs) ||
+        !reader.Read(loaded.offsetstarts, nrefs + 1) || !reader.Read(loaded.limbs, nlimbs) || !reader.Read(loaded.norms, nlimbs) ||
+        !reader.Read(loaded.offsetlimbs, noffsetlimbs)) {
+        return false;
+    }
+    const uint8_t* dicttable = reader.Next(ndicts * DICT_SIZE);
+    if (!dicttable) {
+        return false;
+    }
+    loaded.dicts.reserve(ndicts);
+    for (uint64_t i = 0; i < ndicts; i++) {
+        const uint8_t* p = dicttable + i * DICT_SIZE;
+        uint64_t len = ReadLE32(p);
+        uint64_t count = ReadLE32(p + 4);
+        bool hashed = ReadLE32(p + 8) != 0;
+        const uint8_t* strings = reader.At(ReadLE64(p + 16), len * count);
+        const uint8_t* prefixes = reader.At(ReadLE64(p + 24), count * 8);
+        const uint8_t* slots = hashed ? reader.At(ReadLE64(p + 32), count * 4) : nullptr;
+        const uint8_t* seeds = hashed ? reader.At(ReadLE64(p + 40), PerfectHashBuckets(count) * 4) : nullptr;
+        if (count == 0 || len > 0x7FFFFFFF || !strings || !prefixes || (hashed && (!slots || !seeds))) {
+            return false;
+        }
+        // A slot out of range would make find read past the strings.
+        const uint32_t* slotarr = reinterpret_cast<const uint32_t*>(slots);
+        for (uint64_t j = 0; hashed && j < count; j++) {
+            if (slotarr[j] >= count) {
+                return false;
+            }
+        }
+        loaded.dicts.emplace_back(reinterpret_cast<const char*>(strings), len, count, reinterpret_cast<const uint64_t*>(prefixes), slotarr, reinterpret_cast<const uint32_t*>(seeds));
+    }
+    if (!CheckGraph(loaded)) {
+        return false;
+    }
+    loaded.storage = std::move(storage);
+    graph = std::move(loaded);
+    return true;
+}
@@ -5,15 +5,44 @@ namespace {
 
 uint64_t readnum(FILE* f) {
     uint64_t ret = 0;
-    uint8_t c;
+    int c;
     do {
         c = getc(f);
+        if (c == EOF) {
+            break;
+        }
         ret = (ret << 7) | (c & 0x7F);
     } while (c & 0x80);
 //    fprintf(stderr, "Read num %lx\n", (unsigned long)ret);
     return ret;
 }
 
+/* Read the perfect hash seeds that may follow the nodes (see Export). Seeds that do not fit their
+ * dictionary are ignored, which leaves it with binary search. */
+void ImportHashes(FlatGraph& graph, FILE* file) {
+    int c = getc(file);
+    if (c == EOF) {
+        return;
+    }
+    ungetc(c, file);
+    if (readnum(file) != 1) {
+        return;
+    }
+    for (Strings& dict : graph.dicts) {
+        uint64_t num = readnum(file);
+        if (feof(file) || num > dict.size()) {
+            return;
+        }
+        std::vector<uint32_t> seeds(num);
+        for (auto& seed : seeds) {
+            seed = readnum(file);
+        }
+        if (num > 0) {
+            dict.SetPerfectHash(std::move(seeds));
+        }
+    }
+}
+
 }
 
 /* c1 * s1 + c2 * (f1 + s2) + c3 * (f1 + f2 + s3) + c4 * (f1 + f2 + f3 + s4)
@@ -27,6 +56,7 @@ void Import(FlatGraph& graph, FILE* file) {
         uint64_t typ = readnum(file);
         switch (typ & 3) {
         case 0:
+            ImportHashes(graph, file);
             return;
         case 1: {
             size_t count = 1 + (typ >> 2);
@@ -41,58 +71,37 @@ void Import(FlatGraph& graph, FILE* file) {
                 }
                 fread(&data[i * len + offset], len - offset, 1, file);
             }
-            std::vector<FlatNode>::iterator node = graph.nodes.emplace(graph.nodes.end(), FlatNode::NodeType::DICT, len);
-            node->dict = graph.dicts.size();
-            graph.dicts.emplace_back(std::move(data), len);
-            node->count = count;
+            graph.AddDict(Strings(std::move(data), len));
 //            fprintf(stderr, "* Dict of %lu words of size %lu\n", (unsigned long)count, (unsigned long)len);
             break;
         }
         case 2: {
             size_t num = 2 + (typ >> 2);
 //            fprintf(stderr, "* Concat of %lu entries\n", (unsigned long)num);
-            BigNum count = 1;
-            int len = 0;
-            std::vector<std::pair<size_t, size_t>> refs;
+            std::vector<std::pair<uint32_t, uint32_t>> refs;
             refs.reserve(num);
             for (size_t i = 0; i < num; i++) {
                 size_t pos = readnum(file);
-                size_t idx = graph.nodes.size() - 1 - readnum(file);
-                assert(idx < graph.nodes.size());
+                size_t idx = graph.size() - 1 - readnum(file);
+                assert(idx < graph.size());
                 refs.emplace_back(pos, idx);
-                count *= graph.nodes[idx].count;
-                len += graph.nodes[idx].len;
-//                fprintf(stderr, "  * Entry %lu of len %lu at post %lu\n", (unsigned long)idx, (unsigned long)graph.nodes[idx].len, (unsigned long)pos);
+//                fprintf(stderr, "  * Entry %lu of len %lu at post %lu\n", (unsigned long)idx, (unsigned long)graph.lens[idx], (unsigned long)pos);
             }
-            std::vector<FlatNode>::iterator node = graph.nodes.emplace(graph.nodes.end(), FlatNode::NodeType::CONCAT, len);
-            node->refs = std::move(refs);
-            node->count = std::move(count);
-//            fprintf(stderr, "  * Total: %s combinations\n", node->count.hex().c_str());
+            graph.AddNode(FlatGraph::NodeType::CONCAT, refs);
             break;
         }
         case 3: {
             size_t num = 2 + (typ >> 2);
-            BigNum count = 0;
-            int len;
 //            fprintf(stderr, "* Disjunct of %lu entries\n", (unsigned long)num);
-            std::vector<std::pair<size_t, size_t>> refs;
+            std::vector<std::pair<uint32_t, uint32_t>> refs;
             refs.reserve(num);
             for (size_t i = 0; i < num; i++) {
-                size_t idx = graph.nodes.size() - 1 - readnum(file);
-                assert(idx < graph.nodes.size());
+                size_t idx = graph.size() - 1 - readnum(file);
+                assert(idx < graph.size());
                 refs.emplace_back(0, idx);
-                count += graph.nodes[idx].count;
-                if (i == 0) {
-                    len = graph.nodes[idx].len;
-                } else if (len != graph.nodes[idx].len) {
-                    len = -1;
-                }
-//                fprintf(stderr, "  * Entry %lu of len %lu\n", (unsigned long)idx, (unsigned long)graph.nodes[idx].len);
+//                fprintf(stderr, "  * Entry %lu of len %lu\n", (unsigned long)idx, (unsigned long)graph.lens[idx]);
             }
-            std::vector<FlatNode>::iterator node = graph.nodes.emplace(graph.nodes.end(), FlatNode::NodeType::DISJUNCT, len);
-            node->refs = std::move(refs);
-            node->count = std::move(count);
-//            fprintf(stderr, "  * Total: %s combinations\n", node->count.hex().c_str());
+            graph.AddNode(FlatGraph::NodeType::DISJUNCT, refs);
             break;
         }
         }
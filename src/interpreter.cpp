@@ -1,105 +1,674 @@
 #include "interpreter.h"
+#include "hashtable.h"
 #include <assert.h>
+#include <algorithm>
 
 namespace {
 
-size_t Generate(std::vector<char>& out, size_t pos, const FlatGraph& graph, const FlatNode* ref, BigNum&& num) {
-//    fprintf(stderr, "gen pos=%i len=%i type=%i\n", (int)pos, (int)ref->len, (int)ref->nodetype);
-    if (ref->len >= 0) {
-        if (out.size() < pos + ref->len) {
-            out.resize(pos + ref->len);
+void AppendLimbs(FlatArray<uint32_t>& pool, const uint32_t* limbs, unsigned int len) {
+    pool.append(limbs, len);
+}
+
+void AppendLimbs(FlatArray<uint32_t>& pool, const BigNum& num) {
+    for (unsigned int i = 0; i < num.limbs(); i++) {
+        pool.push_back(num.limb(i));
+    }
+}
+
+uint32_t AppendNode(FlatGraph& graph, FlatGraph::NodeType type, int len, uint32_t maxlen, uint32_t first, uint32_t num, const BigNum& count, const CharSet& firstchars, const CharSet& lastchars) {
+    graph.types.push_back(type);
+    graph.lens.push_back(len);
+    graph.maxlens.push_back(maxlen);
+    graph.firsts.push_back(first);
+    graph.nums.push_back(num);
+    AppendLimbs(graph.limbs, count);
+    graph.countstarts.push_back(graph.limbs.size());
+    Divisor divisor(count);
+    DivisorRef div = divisor.ref();
+    AppendLimbs(graph.norms, div.norm, div.value.len);
+    graph.shifts.push_back(div.shift);
+    graph.invs.push_back(div.inv);
+    graph.firstchars.push_back(firstchars);
+    graph.lastchars.push_back(lastchars);
+    return graph.types.size() - 1;
+}
+
+size_t Generate(std::string& out, size_t pos, const FlatGraph& graph, uint32_t node, BigNum&& num) {
+//    fprintf(stderr, "gen pos=%i len=%i type=%i\n", (int)pos, (int)graph.lens[node], (int)graph.types[node]);
+    int len = graph.lens[node];
+    if (len >= 0) {
+        if (out.size() < pos + len) {
+            out.resize(pos + len);
         }
     }
-    switch (ref->nodetype) {
-    case FlatNode::NodeType::DICT: {
+    uint32_t first = graph.firsts[node];
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT: {
         assert(num.bits() <= 32);
-        const Strings& strings = graph.dicts[ref->dict];
+        const Strings& strings = graph.dicts[first];
         uint32_t n = num.get_ui();
-        memcpy(out.data() + pos, &*strings.StringBegin(n), ref->len);
-        return pos + ref->len;
-    }
-    case FlatNode::NodeType::DISJUNCT:
-        for (const auto& sub : ref->refs) {
-            const FlatNode* subnode = &graph.nodes[sub.second];
-            if (num < subnode->count) {
-                return Generate(out, pos, graph, subnode, std::move(num));
-            }
-            num -= subnode->count;
-        }
-        assert(false);
-    case FlatNode::NodeType::CONCAT:
-        for (const auto& sub : ref->refs) {
-            const FlatNode* subnode = &graph.nodes[sub.second];
-            BigNum div = num.divmod(subnode->count);
-            Generate(out, pos + sub.first, graph, subnode, std::move(num));
+        memcpy(&out[pos], strings.StringBegin(n), len);
+        return pos + len;
+    }
+    case FlatGraph::NodeType::DISJUNCT: {
+        uint32_t sub = graph.refnodes[graph.SelectRef(node, num)];
+        return Generate(out, pos, graph, sub, std::move(num));
+    }
+    case FlatGraph::NodeType::CONCAT:
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            BigNum div = num.divmod(graph.GetDivisor(sub));
+            Generate(out, pos + graph.refpos[ref], graph, sub, std::move(num));
             num = std::move(div);
         }
-        return pos + ref->len;
+        return pos + len;
     }
     assert(false);
 }
 
-bool Parse(const FlatGraph& graph, const FlatNode* ref, const char* chr, int len, BigNum& out) {
-    if (ref->len >= 0) {
-        if (len != ref->len) {
+bool Parse(const FlatGraph& graph, uint32_t node, const char* chr, int len, BigNum& out) {
+    if (graph.lens[node] >= 0) {
+        if (len != graph.lens[node]) {
             return false;
         }
     }
-    switch (ref->nodetype) {
-    case FlatNode::NodeType::DICT: {
-        const auto& dict = graph.dicts[ref->dict];
+    uint32_t first = graph.firsts[node];
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT: {
+        const auto& dict = graph.dicts[first];
         int ret = dict.find(chr, len);
         if (ret == -1) {
 //            fprintf(stderr, "Not find in dict: %.*s\n", (int)len, chr);
             return false;
         }
         out = ret;
-        assert(out < ref->count);
+        assert(out.compare(graph.CountRef(node)) < 0);
         return true;
     }
-    case FlatNode::NodeType::DISJUNCT: {
-        BigNum ret;
-        out = 0;
-        for (const auto& sub : ref->refs) {
-            const FlatNode* subnode = &graph.nodes[sub.second];
-            if (Parse(graph, subnode, chr, len, ret)) {
-                out += ret;
-                assert(out < ref->count);
+    case FlatGraph::NodeType::DISJUNCT: {
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            if (Parse(graph, graph.refnodes[ref], chr, len, out)) {
+                out += graph.Offset(ref);
+                assert(out.compare(graph.CountRef(node)) < 0);
                 return true;
             }
-            out += subnode->count;
         }
 //        fprintf(stderr, "Not find in disjunct: %.*s\n", (int)len, chr);
         return false;
     }
-    case FlatNode::NodeType::CONCAT: {
+    case FlatGraph::NodeType::CONCAT: {
         BigNum mult = 1;
         BigNum ret;
         out = 0;
-        for (const auto& sub : ref->refs) {
-            const FlatNode* subnode = &graph.nodes[sub.second];
-            if (!Parse(graph, subnode, chr + sub.first, subnode->len, ret)) {
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            if (!Parse(graph, sub, chr + graph.refpos[ref], graph.lens[sub], ret)) {
 //                fprintf(stderr, "Not find in concat: %.*s\n", (int)len, chr);
                 return false;
             }
             out += mult * ret;
-            mult *= subnode->count;
+            mult *= graph.CountRef(sub);
         }
-        assert(out < ref->count);
+        assert(out.compare(graph.CountRef(node)) < 0);
         return true;
     }
     }
     assert(false);
 }
 
+/* Whether the numbers below the count of node fit in 64 bits. */
+bool Fits64(const FlatGraph& graph, uint32_t node) {
+    return graph.countstarts[node + 1] - graph.countstarts[node] <= 2;
+}
+
+uint64_t Get64(const LimbRef& ref) {
+    return (ref.len > 0 ? ref.limbs[0] : 0) | (ref.len > 1 ? (uint64_t)ref.limbs[1] << 32 : 0);
+}
+
+uint64_t Get64(const BigNum& num) {
+    return (num.limbs() > 0 ? num.limb(0) : 0) | (num.limbs() > 1 ? (uint64_t)num.limb(1) << 32 : 0);
+}
+
+/* SelectRef for a DISJUNCT node whose count fits in 64 bits. */
+uint32_t SelectRef64(const FlatGraph& graph, uint32_t node, uint64_t& num) {
+    uint32_t lo = graph.firsts[node], hi = lo + graph.nums[node];
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (num >= Get64(graph.Offset(mid))) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    num -= Get64(graph.Offset(lo));
+    return lo;
+}
+
+/* Whether the bytes at the boundaries of the subphrases of CONCAT node, for the phrase starting
+ * at chr, are ones the refs can start and end with. */
+bool Viable(const FlatGraph& graph, uint32_t node, const char* chr) {
+    uint32_t first = graph.firsts[node];
+    for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+        uint32_t sub = graph.refnodes[ref];
+        int sublen = graph.lens[sub];
+        const char* subchr = chr + graph.refpos[ref];
+        if (sublen > 0 && (!graph.firstchars[sub].has(subchr[0]) || !graph.lastchars[sub].has(subchr[sublen - 1]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+uint32_t FlatGraph::SelectRef(uint32_t node, BigNum& num) const {
+    // Find the last ref whose offset is not above num; the first one's is zero.
+    uint32_t lo = firsts[node], hi = lo + nums[node];
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (num.compare(Offset(mid)) >= 0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    num -= Offset(lo);
+    assert(num.compare(CountRef(refnodes[lo])) < 0);
+    return lo;
+}
+
+uint32_t FlatGraph::AddDict(Strings&& dict) {
+    dicts.emplace_back(std::move(dict));
+    const Strings& strings = dicts.back();
+    size_t len = strings.length();
+    CharSet firstset, lastset;
+    for (size_t i = 0; len > 0 && i < strings.size(); i++) {
+        firstset.add(strings.StringBegin(i)[0]);
+        lastset.add(strings.StringBegin(i)[len - 1]);
+    }
+    return AppendNode(*this, NodeType::DICT, len, len, dicts.size() - 1, 0, BigNum(strings.size()), firstset, lastset);
+}
+
+uint32_t FlatGraph::AddNode(NodeType type, const std::vector<std::pair<uint32_t, uint32_t>>& refs) {
+    assert(type != NodeType::DICT);
+    BigNum count = type == NodeType::CONCAT ? 1 : 0;
+    int len = 0;
+    uint32_t maxlen = 0;
+    CharSet firstset, lastset;
+    uint32_t first = refpos.size();
+    for (size_t i = 0; i < refs.size(); i++) {
+        uint32_t sub = refs[i].second;
+        assert(sub < types.size());
+        refpos.push_back(refs[i].first);
+        refnodes.push_back(sub);
+        if (type == NodeType::CONCAT) {
+            count *= CountRef(sub);
+            len += lens[sub];
+            maxlen = len;
+        } else {
+            firstset |= firstchars[sub];
+            lastset |= lastchars[sub];
+            AppendLimbs(offsetlimbs, count);
+            count += CountRef(sub);
+            if (i == 0) {
+                len = lens[sub];
+            } else if (len != lens[sub]) {
+                len = -1;
+            }
+            maxlen = std::max(maxlen, maxlens[sub]);
+        }
+        offsetstarts.push_back(offsetlimbs.size());
+    }
+    if (type == NodeType::CONCAT) {
+        // The phrases start in the non-empty subphrase at position 0, and end in the one that
+        // reaches the end.
+        for (size_t i = 0; i < refs.size(); i++) {
+            uint32_t sub = refs[i].second;
+            if (lens[sub] > 0 && refs[i].first == 0) {
+                firstset = firstchars[sub];
+            }
+            if (lens[sub] > 0 && refs[i].first + lens[sub] == (uint32_t)len) {
+                lastset = lastchars[sub];
+            }
+        }
+    }
+    return AppendNode(*this, type, len, maxlen, first, refs.size(), count, firstset, lastset);
+}
+
+size_t Evaluator::Generate(const FlatGraph& graph, uint32_t node, BigNum&& num, char* out) {
+    // Only DISJUNCT nodes can have phrases of varying length. Select through them first to find
+    // the length of this phrase.
+    while (graph.lens[node] < 0) {
+        node = graph.refnodes[graph.SelectRef(node, num)];
+    }
+    size_t len = graph.lens[node];
+    genstack.clear();
+    genstack.emplace_back(node, 0, std::move(num));
+    while (!genstack.empty()) {
+        GenerateFrame& frame = genstack.back();
+        node = frame.node;
+        while (graph.types[node] == FlatGraph::NodeType::DISJUNCT) {
+            node = graph.refnodes[graph.SelectRef(node, frame.num)];
+        }
+        if (graph.types[node] == FlatGraph::NodeType::DICT) {
+            assert(frame.num.bits() <= 32);
+            memcpy(out + frame.pos, graph.dicts[graph.firsts[node]].StringBegin(frame.num.get_ui()), graph.lens[node]);
+            genstack.pop_back();
+            continue;
+        }
+        // Split the number of a CONCAT node into the numbers of its refs. Phrases of dictionaries
+        // are written right away, the others are pushed.
+        BigNum rest = std::move(frame.num);
+        uint32_t pos = frame.pos;
+        genstack.pop_back();
+        uint32_t first = graph.firsts[node];
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            BigNum div = rest.divmod(graph.GetDivisor(sub));
+            if (graph.types[sub] == FlatGraph::NodeType::DICT) {
+                memcpy(out + pos + graph.refpos[ref], graph.dicts[graph.firsts[sub]].StringBegin(rest.get_ui()), graph.lens[sub]);
+            } else {
+                genstack.emplace_back(sub, pos + graph.refpos[ref], std::move(rest));
+            }
+            rest = std::move(div);
+        }
+    }
+    return len;
+}
+
+void Evaluator::ClearFailed() {
+    failcount = 0;
+    if (++failstamp == 0) {
+        for (FailSlot& slot : failslots) {
+            slot.stamp = 0;
+        }
+        failstamp = 1;
+    }
+}
+
+bool Evaluator::Failed(uint64_t key) const {
+    if (failslots.empty()) {
+        return false;
+    }
+    size_t mask = failslots.size() - 1;
+    for (size_t pos = HashCombine(0, key) & mask; failslots[pos].stamp == failstamp; pos = (pos + 1) & mask) {
+        if (failslots[pos].key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Evaluator::AddFailed(uint64_t key) {
+    if (2 * (failcount + 1) > failslots.size()) {
+        std::vector<FailSlot> old(failslots.empty() ? 64 : failslots.size() * 2, FailSlot{0, 0});
+        old.swap(failslots);
+        failcount = 0;
+        for (const FailSlot& slot : old) {
+            if (slot.stamp == failstamp) {
+                AddFailed(slot.key);
+            }
+        }
+    }
+    size_t mask = failslots.size() - 1;
+    size_t pos = HashCombine(0, key) & mask;
+    while (failslots[pos].stamp == failstamp) {
+        pos = (pos + 1) & mask;
+    }
+    failslots[pos].key = key;
+    failslots[pos].stamp = failstamp;
+    failcount++;
+}
+
+bool Evaluator::Parse(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out) {
+    // Entering a node either pushes a frame for it, or produces a result right away (for
+    // dictionaries, and for nodes that cannot match: because of the length, the bytes at the
+    // ends of the phrase or of its subphrases, or because they already failed at the same
+    // position). A result is handed to the
+    // frame on top of the stack, until none is left.
+    bool ok = false;
+    bool result = false;
+    // Variable-length nodes are only reached through DISJUNCTs, so they always get the whole
+    // phrase, and a node and position determine the length.
+    auto key = [&](uint32_t sub, const char* chr) { return ((uint64_t)sub << 32) | (uint32_t)(chr - str); };
+    auto enter = [&](uint32_t sub, const char* chr, int sublen) {
+        result = true;
+        if (graph.lens[sub] >= 0 && sublen != graph.lens[sub]) {
+            ok = false;
+        } else if (sublen > 0 && (!graph.firstchars[sub].has(chr[0]) || !graph.lastchars[sub].has(chr[sublen - 1]))) {
+            ok = false;
+        } else if (graph.types[sub] == FlatGraph::NodeType::DICT) {
+            int ret = graph.dicts[graph.firsts[sub]].find(chr, sublen);
+            ok = ret != -1;
+            if (ok) {
+                out = ret;
+            }
+        } else if (Failed(key(sub, chr)) || (graph.types[sub] == FlatGraph::NodeType::CONCAT && !Viable(graph, sub, chr))) {
+            ok = false;
+        } else {
+            parsestack.emplace_back(sub, graph.firsts[sub], chr, sublen);
+            result = false;
+        }
+    };
+
+    parsestack.clear();
+    ClearFailed();
+    enter(node, str, len);
+    while (!parsestack.empty()) {
+        ParseFrame& frame = parsestack.back();
+        bool concat = graph.types[frame.node] == FlatGraph::NodeType::CONCAT;
+        if (result) {
+            uint32_t end = graph.firsts[frame.node] + graph.nums[frame.node];
+            if (!concat) {
+                // DISJUNCT: done at the first ref that matches, otherwise try the next one.
+                if (ok) {
+                    out += graph.Offset(frame.ref);
+                    parsestack.pop_back();
+                    continue;
+                }
+                if (++frame.ref == end) {
+                    AddFailed(key(frame.node, frame.chr));
+                    parsestack.pop_back();
+                    continue;
+                }
+            } else {
+                // CONCAT: every ref must match.
+                if (!ok) {
+                    AddFailed(key(frame.node, frame.chr));
+                    parsestack.pop_back();
+                    continue;
+                }
+                frame.out += frame.mult * out;
+                frame.mult *= graph.CountRef(graph.refnodes[frame.ref]);
+                if (++frame.ref == end) {
+                    out = std::move(frame.out);
+                    parsestack.pop_back();
+                    continue;
+                }
+            }
+        }
+        uint32_t sub = graph.refnodes[frame.ref];
+        if (concat) {
+            enter(sub, frame.chr + graph.refpos[frame.ref], graph.lens[sub]);
+        } else {
+            enter(sub, frame.chr, frame.len);
+        }
+    }
+    return ok;
+}
+
+size_t Evaluator::AllocBatch(const FlatGraph& graph, uint32_t node, size_t count) {
+    if (Fits64(graph, node)) {
+        nums64.resize(nums64.size() + count);
+        poss.resize(nums64.size());
+        return nums64.size() - count;
+    }
+    widenums.resize(widenums.size() + count);
+    wideposs.resize(widenums.size());
+    return widenums.size() - count;
+}
+
+static const size_t BATCH_MIN = 8;
+
+void Evaluator::Generate64(const FlatGraph& graph, uint32_t node, uint64_t num, char* out) {
+    smallstack.clear();
+    smallnums.clear();
+    smallstack.emplace_back(node, 0);
+    smallnums.push_back(num);
+    while (!smallstack.empty()) {
+        node = smallstack.back().first;
+        size_t pos = smallstack.back().second;
+        num = smallnums.back();
+        smallstack.pop_back();
+        smallnums.pop_back();
+        while (graph.types[node] == FlatGraph::NodeType::DISJUNCT) {
+            node = graph.refnodes[SelectRef64(graph, node, num)];
+        }
+        if (graph.types[node] == FlatGraph::NodeType::DICT) {
+            memcpy(out + pos, graph.dicts[graph.firsts[node]].StringBegin(num), graph.lens[node]);
+            continue;
+        }
+        uint32_t first = graph.firsts[node];
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            uint64_t count = Get64(graph.CountRef(sub));
+            uint64_t div = num / count;
+            uint64_t digit = num - div * count;
+            if (graph.types[sub] == FlatGraph::NodeType::DICT) {
+                memcpy(out + pos + graph.refpos[ref], graph.dicts[graph.firsts[sub]].StringBegin(digit), graph.lens[sub]);
+            } else {
+                smallstack.emplace_back(sub, pos + graph.refpos[ref]);
+                smallnums.push_back(digit);
+            }
+            num = div;
+        }
+    }
+}
+
+void Evaluator::SplitBatch(const FlatGraph& graph, const BatchFrame& frame, char* out) {
+    uint32_t node = frame.node;
+    uint32_t first = graph.firsts[node];
+    size_t size = frame.end - frame.begin;
+    if (size == 1) {
+        // Nothing to gain from the batch code for a single number.
+        if (frame.wide) {
+            Generate(graph, node, std::move(widenums[frame.begin]), out + wideposs[frame.begin]);
+        } else {
+            Generate64(graph, node, nums64[frame.begin], out + poss[frame.begin]);
+        }
+        return;
+    }
+    switch (graph.types[node]) {
+    case FlatGraph::NodeType::DICT: {
+        const Strings& dict = graph.dicts[first];
+        for (size_t i = frame.begin; i < frame.end; i++) {
+            memcpy(out + poss[i], dict.StringBegin(nums64[i]), dict.length());
+        }
+        return;
+    }
+    case FlatGraph::NodeType::DISJUNCT: {
+        // Group the numbers by ref, with a counting sort.
+        batchorder.resize(size);
+        batchcounts.assign(graph.nums[node], 0);
+        for (size_t i = 0; i < size; i++) {
+            uint32_t ref = frame.wide ? graph.SelectRef(node, widenums[frame.begin + i]) : SelectRef64(graph, node, nums64[frame.begin + i]);
+            batchorder[i] = ref - first;
+            batchcounts[ref - first]++;
+        }
+        size_t groupstart = batchstack.size();
+        for (uint32_t j = 0; j < graph.nums[node]; j++) {
+            if (batchcounts[j] > 0) {
+                uint32_t sub = graph.refnodes[first + j];
+                size_t begin = AllocBatch(graph, sub, batchcounts[j]);
+                batchstack.push_back(BatchFrame{sub, !Fits64(graph, sub), begin, begin + batchcounts[j], 0, 0});
+                batchcounts[j] = begin;
+            }
+        }
+        for (size_t i = 0; i < size; i++) {
+            uint32_t j = batchorder[i];
+            size_t to = batchcounts[j]++;
+            if (!Fits64(graph, graph.refnodes[first + j])) {
+                widenums[to] = std::move(widenums[frame.begin + i]);
+                wideposs[to] = wideposs[frame.begin + i];
+            } else if (frame.wide) {
+                nums64[to] = Get64(widenums[frame.begin + i]);
+                poss[to] = wideposs[frame.begin + i];
+            } else {
+                nums64[to] = nums64[frame.begin + i];
+                poss[to] = poss[frame.begin + i];
+            }
+        }
+        for (size_t j = groupstart; j < batchstack.size(); j++) {
+            batchstack[j].widetop = widenums.size();
+            batchstack[j].top = nums64.size();
+        }
+        return;
+    }
+    case FlatGraph::NodeType::CONCAT: {
+        // Split the numbers into the numbers of the refs, one ref at a time. Phrases of
+        // dictionaries are written right away, the others get a frame.
+        size_t groupstart = batchstack.size();
+        for (uint32_t ref = first; ref < first + graph.nums[node]; ref++) {
+            uint32_t sub = graph.refnodes[ref];
+            uint32_t refpos = graph.refpos[ref];
+            if (graph.types[sub] == FlatGraph::NodeType::DICT) {
+                const Strings& dict = graph.dicts[graph.firsts[sub]];
+                uint64_t count = dict.size();
+                for (size_t i = frame.begin; i < frame.end; i++) {
+                    uint64_t digit;
+                    if (frame.wide) {
+                        BigNum div = widenums[i].divmod(graph.GetDivisor(sub));
+                        digit = widenums[i].get_ui();
+                        widenums[i] = std::move(div);
+                        memcpy(out + wideposs[i] + refpos, dict.StringBegin(digit), dict.length());
+                    } else {
+                        digit = nums64[i] % count;
+                        nums64[i] /= count;
+                        memcpy(out + poss[i] + refpos, dict.StringBegin(digit), dict.length());
+                    }
+                }
+                continue;
+            }
+            size_t begin = AllocBatch(graph, sub, size);
+            bool wide = !Fits64(graph, sub);
+            batchstack.push_back(BatchFrame{sub, wide, begin, begin + size, 0, 0});
+            if (!frame.wide) {
+                uint64_t count = Get64(graph.CountRef(sub));
+                for (size_t i = 0; i < size; i++) {
+                    uint64_t num = nums64[frame.begin + i];
+                    uint64_t div = num / count;
+                    nums64[begin + i] = num - div * count;
+                    poss[begin + i] = poss[frame.begin + i] + refpos;
+                    nums64[frame.begin + i] = div;
+                }
+                continue;
+            }
+            DivisorRef divisor = graph.GetDivisor(sub);
+            for (size_t i = 0; i < size; i++) {
+                BigNum& num = widenums[frame.begin + i];
+                BigNum div = num.divmod(divisor);
+                if (wide) {
+                    widenums[begin + i] = std::move(num);
+                    wideposs[begin + i] = wideposs[frame.begin + i] + refpos;
+                } else {
+                    nums64[begin + i] = Get64(num);
+                    poss[begin + i] = wideposs[frame.begin + i] + refpos;
+                }
+                num = std::move(div);
+            }
+        }
+        for (size_t j = groupstart; j < batchstack.size(); j++) {
+            batchstack[j].widetop = widenums.size();
+            batchstack[j].top = nums64.size();
+        }
+        return;
+    }
+    }
+}
+
+void Evaluator::GenerateBatch(const FlatGraph& graph, uint32_t node, const std::vector<BigNum>& nums, std::string& out, std::vector<size_t>& ends) {
+    // Select through the DISJUNCTs of varying length first, as in Generate, to find where each
+    // phrase goes. Numbers that end up at the same node start out as one group.
+    widenums.assign(nums.begin(), nums.end());
+    wideposs.resize(nums.size());
+    batchorder.resize(nums.size());
+    ends.resize(nums.size());
+    size_t pos = out.size();
+    for (size_t i = 0; i < nums.size(); i++) {
+        uint32_t sub = node;
+        while (graph.lens[sub] < 0) {
+            sub = graph.refnodes[graph.SelectRef(sub, widenums[i])];
+        }
+        batchorder[i] = sub;
+        wideposs[i] = pos;
+        pos += graph.lens[sub];
+        ends[i] = pos;
+    }
+    out.resize(pos);
+
+    std::vector<size_t>& order = batchcounts;
+    order.resize(nums.size());
+    for (size_t i = 0; i < nums.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return batchorder[a] < batchorder[b]; });
+    nums64.clear();
+    poss.clear();
+    batchstack.clear();
+    size_t inputs = nums.size();
+    for (size_t i = 0; i < inputs;) {
+        uint32_t sub = batchorder[order[i]];
+        size_t j = i;
+        while (j < inputs && batchorder[order[j]] == sub) {
+            j++;
+        }
+        size_t begin = AllocBatch(graph, sub, j - i);
+        for (size_t k = i; k < j; k++) {
+            if (Fits64(graph, sub)) {
+                nums64[begin + k - i] = Get64(widenums[order[k]]);
+                poss[begin + k - i] = wideposs[order[k]];
+            } else {
+                widenums[begin + k - i] = std::move(widenums[order[k]]);
+                wideposs[begin + k - i] = wideposs[order[k]];
+            }
+        }
+        batchstack.push_back(BatchFrame{sub, !Fits64(graph, sub), begin, begin + j - i, 0, 0});
+        i = j;
+    }
+    for (BatchFrame& frame : batchstack) {
+        frame.widetop = widenums.size();
+        frame.top = nums64.size();
+    }
+
+    char* base = &out[0];
+    while (!batchstack.empty()) {
+        BatchFrame frame = batchstack.back();
+        batchstack.pop_back();
+        // What lies beyond the frame's tops belongs to frames that are done.
+        widenums.resize(frame.widetop);
+        wideposs.resize(frame.widetop);
+        nums64.resize(frame.top);
+        poss.resize(frame.top);
+        SplitBatch(graph, frame, base);
+    }
+}
+
+bool ParseRecursive(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out) {
+    return Parse(graph, node, str, (int)len, out);
+}
+
+void GenerateRecursive(const FlatGraph& graph, uint32_t node, BigNum&& num, std::string& out) {
+    size_t len = Generate(out, out.size(), graph, node, std::move(num));
+    out.resize(len);
+}
+
+namespace {
+
+thread_local Evaluator evaluator;
+
+}
+
+bool Parse(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out) {
+    return evaluator.Parse(graph, node, str, len, out);
+}
+
+bool Parse(const FlatGraph& graph, uint32_t node, const std::string& str, BigNum& out) {
+    return Parse(graph, node, str.data(), str.size(), out);
+}
+
+void Generate(const FlatGraph& graph, uint32_t node, BigNum&& num, std::string& out) {
+    size_t pos = out.size();
+    out.resize(pos + graph.maxlens[node]);
+    size_t len = evaluator.Generate(graph, node, std::move(num), &out[pos]);
+    out.resize(pos + len);
 }
 
-bool Parse(const FlatGraph& graph, const FlatNode* ref, const std::string& str, BigNum& out) {
-    return Parse(graph, ref, str.data(), str.size(), out);
+void GenerateBatch(const FlatGraph& graph, uint32_t node, const std::vector<BigNum>& nums, std::string& out, std::vector<size_t>& ends) {
+    evaluator.GenerateBatch(graph, node, nums, out, ends);
 }
 
-std::string Generate(const FlatGraph& graph, const FlatNode* ref, BigNum&& num) {
-    std::vector<char> out;
-    size_t len = Generate(out, 0, graph, ref, std::move(num));
-    return std::string(out.begin(), out.begin() + len);
+std::string Generate(const FlatGraph& graph, uint32_t node, BigNum&& num) {
+    std::string out;
+    Generate(graph, node, std::move(num), out);
+    return out;
 }
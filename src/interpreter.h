@@ -4,29 +4,213 @@
 #include "bignum.h"
 #include <vector>
 #include <string>
+#include <memory>
+#include "flatarray.h"
 #include "strings.h"
 
-struct FlatNode {
-    enum NodeType {
+/* A set of byte values. */
+struct CharSet {
+    uint64_t bits[4];
+
+    CharSet() : bits{0, 0, 0, 0} {}
+
+    bool has(unsigned char c) const { return (bits[c >> 6] >> (c & 63)) & 1; }
+    void add(unsigned char c) { bits[c >> 6] |= (uint64_t)1 << (c & 63); }
+    CharSet& operator|=(const CharSet& other) {
+        for (int i = 0; i < 4; i++) {
+            bits[i] |= other.bits[i];
+        }
+        return *this;
+    }
+};
+
+/* A compiled grammar, laid out as a struct of arrays so that the data Generate and Parse touch
+ * stays small and contiguous. Nodes and refs are numbered with 32-bit indices; every node only
+ * refers to nodes before it, and the last node is the root.
+ *
+ * Numbers live in shared limb pools: node i's count is limbs[countstarts[i]..countstarts[i+1]),
+ * and norms holds the normalized limbs of the same count at the same positions, for dividing by
+ * it (see Divisor). Node i's refs are [firsts[i], firsts[i] + nums[i]); a DICT node has no refs,
+ * and firsts holds its dictionary index instead. For the refs of a DISJUNCT node, the offset
+ * (sum of the counts of the refs before it) is offsetlimbs[offsetstarts[j]..offsetstarts[j+1]).
+ *
+ * For decoding, firstchars and lastchars hold the bytes that the node's non-empty phrases can
+ * start and end with. Parse uses them to skip the refs of a DISJUNCT that cannot match without
+ * descending into them.
+ *
+ * A graph loaded from an image file (see image.h) refers to the arrays in the mapped file instead
+ * of owning them, and cannot be added to. */
+struct FlatGraph {
+    enum NodeType : uint8_t {
         DICT,
         DISJUNCT,
         CONCAT
     };
-    NodeType nodetype;
-    BigNum count;
-    size_t dict;
-    std::vector<std::pair<size_t, size_t>> refs;
-    int len;
 
-    FlatNode(NodeType typ, int len_) : nodetype(typ), count(0), dict(0), len(len_) {}
-};
+    // Per node.
+    FlatArray<uint8_t> types;
+    FlatArray<int32_t> lens; // -1 if phrases of the node vary in length.
+    FlatArray<uint32_t> maxlens; // Length of the longest phrase of the node.
+    FlatArray<uint32_t> firsts;
+    FlatArray<uint32_t> nums;
+    FlatArray<uint32_t> countstarts; // One more entry than there are nodes.
+    FlatArray<uint8_t> shifts;
+    FlatArray<uint32_t> invs;
+    FlatArray<CharSet> firstchars;
+    FlatArray<CharSet> lastchars;
 
-struct FlatGraph {
-    std::vector<FlatNode> nodes;
+    // Per ref.
+    FlatArray<uint32_t> refpos; // For CONCAT: position of the subphrase.
+    FlatArray<uint32_t> refnodes;
+    FlatArray<uint32_t> offsetstarts; // One more entry than there are refs.
+
+    FlatArray<uint32_t> limbs;
+    FlatArray<uint32_t> norms;
+    FlatArray<uint32_t> offsetlimbs;
     std::vector<Strings> dicts;
+    std::shared_ptr<const void> storage; // Keeps externally owned arrays and dictionary data (e.g. a mapped file) alive.
+
+    FlatGraph() : countstarts(1, 0), offsetstarts(1, 0) {}
+
+    size_t size() const { return types.size(); }
+    uint32_t root() const { return types.size() - 1; }
+
+    LimbRef CountRef(uint32_t node) const {
+        LimbRef ret = {limbs.data() + countstarts[node], countstarts[node + 1] - countstarts[node]};
+        return ret;
+    }
+
+    BigNum Count(uint32_t node) const {
+        LimbRef ref = CountRef(node);
+        return BigNum(ref.limbs, ref.len);
+    }
+
+    DivisorRef GetDivisor(uint32_t node) const {
+        DivisorRef ret = {CountRef(node), norms.data() + countstarts[node], shifts[node], invs[node]};
+        return ret;
+    }
+
+    LimbRef Offset(uint32_t ref) const {
+        LimbRef ret = {offsetlimbs.data() + offsetstarts[ref], offsetstarts[ref + 1] - offsetstarts[ref]};
+        return ret;
+    }
+
+    /* For a number num below the count of DISJUNCT node, return the ref it falls in, and
+     * subtract that ref's offset from num. */
+    uint32_t SelectRef(uint32_t node, BigNum& num) const;
+
+    /* Append a node with the strings in dict. Returns its index. */
+    uint32_t AddDict(Strings&& dict);
+
+    /* Append a DISJUNCT or CONCAT node with the given (position, node index) refs, computing its
+     * length and count from them. Returns its index. */
+    uint32_t AddNode(NodeType type, const std::vector<std::pair<uint32_t, uint32_t>>& refs);
+};
+
+/* Evaluates Generate and Parse with an explicit stack instead of recursion. The stack is kept
+ * between calls, so once warmed up no allocations are needed. Use one per thread. */
+class Evaluator {
+    struct GenerateFrame {
+        uint32_t node;
+        uint32_t pos;
+        BigNum num;
+
+        GenerateFrame(uint32_t node_, uint32_t pos_, BigNum&& num_) : node(node_), pos(pos_), num(std::move(num_)) {}
+    };
+
+    struct ParseFrame {
+        uint32_t node;
+        uint32_t ref; // The ref being parsed.
+        const char* chr;
+        int len;
+        BigNum out;
+        BigNum mult;
+
+        ParseFrame(uint32_t node_, uint32_t ref_, const char* chr_, int len_) : node(node_), ref(ref_), chr(chr_), len(len_), mult(1) {}
+    };
+
+    /* A group of numbers in a batch that are all below the count of node, with the positions
+     * their phrases go to. Numbers below 2^64 are kept as such, the others as BigNums. */
+    struct BatchFrame {
+        uint32_t node;
+        bool wide; // Whether the numbers are in widenums rather than nums64.
+        size_t begin;
+        size_t end;
+        size_t widetop; // Sizes of widenums and nums64 to go back to when the frame is taken.
+        size_t top;
+    };
+
+    struct FailSlot {
+        uint64_t key;
+        uint32_t stamp;
+    };
+
+    std::vector<GenerateFrame> genstack;
+    std::vector<ParseFrame> parsestack;
+
+    std::vector<BatchFrame> batchstack;
+    std::vector<BigNum> widenums;
+    std::vector<size_t> wideposs;
+    std::vector<uint64_t> nums64;
+    std::vector<size_t> poss;
+    std::vector<uint32_t> batchorder;
+    std::vector<size_t> batchcounts;
+    std::vector<std::pair<uint32_t, size_t>> smallstack; // Nodes and positions for Generate64.
+    std::vector<uint64_t> smallnums;
+
+    /* Make room for count numbers below the count of node, in widenums or nums64, and return
+     * where they start. */
+    size_t AllocBatch(const FlatGraph& graph, uint32_t node, size_t count);
+    void SplitBatch(const FlatGraph& graph, const BatchFrame& frame, char* out);
+    /* Generate for a fixed-length node whose count fits in 64 bits. */
+    void Generate64(const FlatGraph& graph, uint32_t node, uint64_t num, char* out);
+
+    /* The (node, position) pairs that failed to parse during the current Parse call, so that
+     * refs of different DISJUNCTs sharing a subphrase do not parse it again. Slots from earlier
+     * calls have an older stamp, so the set is emptied by incrementing failstamp. */
+    std::vector<FailSlot> failslots;
+    size_t failcount;
+    uint32_t failstamp;
+
+    void ClearFailed();
+    bool Failed(uint64_t key) const;
+    void AddFailed(uint64_t key);
+
+public:
+    Evaluator() : failcount(0), failstamp(0) {}
+
+    /* Write the phrase for num to out, which must have room for graph.maxlens[node] bytes.
+     * Returns the length of the phrase. */
+    size_t Generate(const FlatGraph& graph, uint32_t node, BigNum&& num, char* out);
+
+    /* Append the phrases for all of nums to out, back to back, and set ends[i] to the position
+     * in out just after the phrase for nums[i]. Instead of walking the graph once per number,
+     * the numbers are walked down together: a DISJUNCT splits its group by ref, and a CONCAT
+     * divides all numbers of its group by the same count in one loop, in 64-bit arithmetic
+     * once the counts fit. */
+    void GenerateBatch(const FlatGraph& graph, uint32_t node, const std::vector<BigNum>& nums, std::string& out, std::vector<size_t>& ends);
+
+    /* Set out to the number of the phrase str of node, if it is one. A DISJUNCT still tries its
+     * refs in turn, skipping those ruled out by length, by the bytes at the ends of the phrase
+     * (firstchars and lastchars) or by an earlier failure at the same position. A table from the
+     * first byte to a single ref would not help much: in the bundled grammars, 2.5 (dutch) to 8
+     * (silly at 256 bits) refs per DISJUNCT still pass those checks, as alternatives often share
+     * their first and last bytes. */
+    bool Parse(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out);
 };
 
-bool Parse(const FlatGraph& graph, const FlatNode* ref, const std::string& str, BigNum& out);
-std::string Generate(const FlatGraph& graph, const FlatNode* ref, BigNum&& num);
+bool Parse(const FlatGraph& graph, uint32_t node, const std::string& str, BigNum& out);
+bool Parse(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out);
+std::string Generate(const FlatGraph& graph, uint32_t node, BigNum&& num);
+
+/* Append the phrase for num to out. Does not allocate once out has enough capacity. */
+void Generate(const FlatGraph& graph, uint32_t node, BigNum&& num, std::string& out);
+
+/* See Evaluator::GenerateBatch. */
+void GenerateBatch(const FlatGraph& graph, uint32_t node, const std::vector<BigNum>& nums, std::string& out, std::vector<size_t>& ends);
+
+/* The straightforward recursive versions of the above, kept as a reference for benchmarks. */
+void GenerateRecursive(const FlatGraph& graph, uint32_t node, BigNum&& num, std::string& out);
+bool ParseRecursive(const FlatGraph& graph, uint32_t node, const char* str, size_t len, BigNum& out);
 
 #endif
@@ -598,8 +598,6 @@ std::string Parse(Graph& graph, Graph::Ref& mainout, const char* str, size_t len
         return "undefined symbol";
     }
 
-    Optimize(graph);
-    OptimizeRef(graph, main);
     mainout = std::move(main);
     return "";
 }
@@ -3,6 +3,8 @@
 
 #include "graph.h"
 
+/* Parse the grammar in str into graph, setting mainout to its main symbol. Returns an error
+ * message, or an empty string on success. The graph is not optimized; see Optimize. */
 std::string Parse(Graph& graph, Graph::Ref& mainout, const char* str, size_t len);
 
 #endif
@@ -0,0 +1,57 @@
+#include "perfecthash.h"
+
+#include <algorithm>
+
+namespace {
+
+static const uint32_t MAX_SEED = 1 << 20;
+
+}
+
+bool BuildPerfectHash(const std::vector<uint64_t>& hashes, std::vector<uint32_t>& seeds) {
+    size_t count = hashes.size();
+    size_t buckets = PerfectHashBuckets(count);
+    std::vector<std::vector<uint64_t>> members(buckets);
+    for (uint64_t hash : hashes) {
+        members[PerfectHashBucket(hash, buckets)].push_back(hash);
+    }
+    // Place the largest buckets first, while most slots are still free.
+    std::vector<uint32_t> order(buckets);
+    for (uint32_t b = 0; b < buckets; b++) {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return members[x].size() > members[y].size(); });
+
+    seeds.assign(buckets, 0);
+    std::vector<bool> taken(count);
+    std::vector<uint32_t> slots;
+    for (uint32_t b : order) {
+        if (members[b].empty()) {
+            break;
+        }
+        uint32_t seed = 0;
+        while (true) {
+            slots.clear();
+            bool ok = true;
+            for (uint64_t hash : members[b]) {
+                uint32_t slot = PerfectHashSlot(hash, seed, count);
+                if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                    ok = false;
+                    break;
+                }
+                slots.push_back(slot);
+            }
+            if (ok) {
+                break;
+            }
+            if (++seed == MAX_SEED) {
+                return false;
+            }
+        }
+        for (uint32_t slot : slots) {
+            taken[slot] = true;
+        }
+        seeds[b] = seed;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef _GRAMTROPY_PERFECTHASH_H_
+#define _GRAMTROPY_PERFECTHASH_H_ 1
+
+#include "hashtable.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Minimal perfect hashing of the strings of a dictionary, in the style of CHD (hash and
+ * displace). Every string is hashed once; the hash picks one of about count / 4 buckets, and each
+ * bucket has a seed that sends the strings in it to slots in [0, count) that no other string
+ * uses. gramc finds the seeds and stores them in the translation file. The slot of every string,
+ * and so the table from slots to indices in sorted order, is recomputed when loading it; image
+ * files (see image.h) store the table as well. */
+
+inline uint64_t PerfectHashWord(const char* str, size_t len) {
+    uint64_t hash = len;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t word = 0;
+        for (size_t j = i; j < i + 8 && j < len; j++) {
+            word = (word << 8) | (unsigned char)str[j];
+        }
+        hash = HashCombine(hash, word);
+    }
+    return hash;
+}
+
+inline size_t PerfectHashBuckets(size_t count) {
+    return (count + 3) / 4;
+}
+
+/* Scale the top 32 bits of hash to [0, range), without dividing. */
+inline uint32_t PerfectHashReduce(uint64_t hash, size_t range) {
+    return ((hash >> 32) * range) >> 32;
+}
+
+inline uint32_t PerfectHashBucket(uint64_t hash, size_t buckets) {
+    return PerfectHashReduce(hash, buckets);
+}
+
+inline uint32_t PerfectHashSlot(uint64_t hash, uint32_t seed, size_t count) {
+    return PerfectHashReduce(HashCombine(hash ^ 0x2545f4914f6cdd1dULL, seed), count);
+}
+
+/* Find a seed per bucket for the strings with the given hashes. Returns false if there are none
+ * within reasonable effort (for example because two hashes are equal). */
+bool BuildPerfectHash(const std::vector<uint64_t>& hashes, std::vector<uint32_t>& seeds);
+
+#endif
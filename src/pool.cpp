@@ -0,0 +1,68 @@
+#include "pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads) : stopping(false), generation(0), active(0), task(nullptr), count(0), blocksize(1), next(0) {
+    for (int i = 1; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::Worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
+void ThreadPool::Work() {
+    size_t begin;
+    while ((begin = next.fetch_add(blocksize)) < count) {
+        (*task)(begin, std::min(begin + blocksize, count));
+    }
+}
+
+void ThreadPool::Worker() {
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        start.wait(lock, [&]() { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        lock.unlock();
+        Work();
+        lock.lock();
+        if (--active == 0) {
+            finish.notify_one();
+        }
+    }
+}
+
+void ThreadPool::Run(size_t count_, size_t blocksize_, const Task& task_) {
+    if (workers.empty() || count_ <= blocksize_) {
+        if (count_ > 0) {
+            task_(0, count_);
+        }
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        task = &task_;
+        count = count_;
+        blocksize = blocksize_;
+        next = 0;
+        active = workers.size();
+        generation++;
+    }
+    start.notify_all();
+    Work();
+    std::unique_lock<std::mutex> lock(mutex);
+    finish.wait(lock, [&]() { return active == 0; });
+    task = nullptr;
+}
@@ -0,0 +1,49 @@
+#ifndef _GRAMTROPY_POOL_H_
+#define _GRAMTROPY_POOL_H_ 1
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads that split loops over an index range between them.
+ * Workers claim small blocks of the range until it is exhausted, so uneven blocks balance out.
+ * The calling thread takes part in the work, and Run returns only once every block is done. */
+class ThreadPool {
+public:
+    typedef std::function<void(size_t begin, size_t end)> Task;
+
+    /* Start threads - 1 workers (the caller is the remaining one). */
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int Threads() const { return workers.size() + 1; }
+
+    /* Call task on disjoint blocks of at most blocksize indices covering [0, count). */
+    void Run(size_t count, size_t blocksize, const Task& task);
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable finish;
+    bool stopping;
+    unsigned long generation;
+    int active;
+
+    const Task* task;
+    size_t count;
+    size_t blocksize;
+    std::atomic<size_t> next;
+
+    void Work();
+    void Worker();
+};
+
+#endif
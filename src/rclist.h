@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <utility>
 #include <new>
+#include <vector>
 
 template <typename T>
 class rclist {
@@ -74,6 +75,40 @@ class rclist {
     mutable base_node deleted;
     bool deleting;
 
+    // With pooling enabled, nodes are carved out of large blocks and recycled through a free
+    // list, and the blocks are only released all at once when the list is destroyed.
+    static const size_t POOL_BLOCK_NODES = 1024;
+    bool pooled;
+    std::vector<void*> blocks;
+    size_t blockused;
+    void* freelist;
+
+    void* allocate() {
+        if (!pooled) {
+            return ::operator new(sizeof(node));
+        }
+        if (freelist) {
+            void* ret = freelist;
+            freelist = *static_cast<void**>(ret);
+            return ret;
+        }
+        if (blocks.empty() || blockused == POOL_BLOCK_NODES) {
+            blocks.push_back(::operator new(sizeof(node) * POOL_BLOCK_NODES));
+            blockused = 0;
+        }
+        return static_cast<char*>(blocks.back()) + sizeof(node) * blockused++;
+    }
+
+    void release(node* n) {
+        n->~node();
+        if (!pooled) {
+            ::operator delete(n);
+            return;
+        }
+        *reinterpret_cast<void**>(n) = freelist;
+        freelist = n;
+    }
+
     class base_iterator {
         base_node* ptr;
 
@@ -100,10 +135,6 @@ class rclist {
             return x.ptr != y.ptr;
         }
 
-        friend bool operator<(const base_iterator& x, const base_iterator& y) {
-            return x.ptr < y.ptr;
-        }
-
         operator bool() const {
             return ptr != nullptr && ptr->count;
         }
@@ -190,7 +221,7 @@ class rclist {
             node* n = static_cast<node*>(deleted.next);
             n->unlink();
             n->destroy();
-            delete n;
+            release(n);
         }
         deleting = false;
     }
@@ -206,7 +237,8 @@ public:
     typedef T* pointer;
     typedef const T* const_pointer;
 
-    rclist() : sentinel(nullptr, 0), count(0), deleted(nullptr, 0), deleting(false) {}
+    /* If pooled is set, nodes are allocated from a pool owned by the list. */
+    explicit rclist(bool pooled_ = false) : sentinel(nullptr, 0), count(0), deleted(nullptr, 0), deleting(false), pooled(pooled_), blockused(0), freelist(nullptr) {}
     rclist(const rclist<T>&) = delete;
     rclist(rclist<T>&&) = delete;
     rclist<T>& operator=(const rclist<T>&) = delete;
@@ -413,7 +445,7 @@ public:
 
     template<typename... Args>
     iterator emplace_back(Args&&... args) {
-        node* n = new node(this, std::forward<Args>(args)...);
+        node* n = new (allocate()) node(this, std::forward<Args>(args)...);
         ++count;
         n->link_before(&sentinel);
         return iterator(n);
@@ -421,7 +453,7 @@ public:
 
     template<typename... Args>
     iterator emplace_front(Args&&... args) {
-        node* n = new node(this, std::forward<Args>(args)...);
+        node* n = new (allocate()) node(this, std::forward<Args>(args)...);
         ++count;
         n->link_after(&sentinel);
         return iterator(n);
@@ -429,7 +461,7 @@ public:
 
     template<typename... Args>
     iterator emplace(const iterator& pos, Args&&... args) {
-        node* n = new node(this, std::forward<Args>(args)...);
+        node* n = new (allocate()) node(this, std::forward<Args>(args)...);
         ++count;
         n->link_before(pos.get());
         return iterator(n);
@@ -441,6 +473,7 @@ public:
 
     ~rclist() {
         if (sentinel.next == &sentinel) {
+            FreeBlocks();
             return;
         }
         base_node* p = sentinel.next;
@@ -457,11 +490,25 @@ public:
             static_cast<node*>(p)->destroy();
             p = p->next;
         }
+        if (pooled) {
+            // The nodes' memory all belongs to the pool blocks.
+            tmp_sentinel.unlink();
+        }
         while (tmp_sentinel.next != &tmp_sentinel) {
             node* n = static_cast<node*>(tmp_sentinel.next);
             n->unlink();
-            delete n;
+            release(n);
+        }
+        FreeBlocks();
+    }
+
+private:
+    void FreeBlocks() {
+        for (void* block : blocks) {
+            ::operator delete(block);
         }
+        blocks.clear();
+        freelist = nullptr;
     }
 };
 
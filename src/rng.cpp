@@ -0,0 +1,177 @@
+#include "rng.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+
+namespace {
+
+static const size_t BUFFER_SIZE = 4096;
+
+bool GetOSRandom(uint8_t* out, size_t len) {
+    while (len > 0) {
+        ssize_t r = getrandom(out, len, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ENOSYS) {
+                return false;
+            }
+            // Kernel without getrandom; fall back to /dev/urandom.
+            FILE* rng = fopen("/dev/urandom", "r");
+            if (!rng) {
+                return false;
+            }
+            size_t n = fread(out, len, 1, rng);
+            fclose(rng);
+            return n == 1;
+        }
+        out += r;
+        len -= r;
+    }
+    return true;
+}
+
+inline uint32_t ReadLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void WriteLE32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+inline uint32_t Rotl(uint32_t v, int c) {
+    return (v << c) | (v >> (32 - c));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d = Rotl(d ^ a, 16); \
+    c += d; b = Rotl(b ^ c, 12); \
+    a += b; d = Rotl(d ^ a, 8); \
+    c += d; b = Rotl(b ^ c, 7);
+
+/* Produce one 64-byte ChaCha20 block, and increment the 64-bit block counter in state[12..13]. */
+void ChaCha20Block(uint32_t* state, uint8_t* out) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        WriteLE32(out + 4 * i, x[i] + state[i]);
+    }
+    if (++state[12] == 0) {
+        ++state[13];
+    }
+}
+
+#undef QUARTERROUND
+
+}
+
+RandomSource::RandomSource(bool bulk_) : pos(BUFFER_SIZE), bitbuf(0), bitcount(0), bulk(bulk_), seeded(false) {
+    buf.resize(BUFFER_SIZE);
+    memset(state, 0, sizeof(state));
+}
+
+RandomSource::~RandomSource() {
+    memset(buf.data(), 0, buf.size());
+    memset(state, 0, sizeof(state));
+}
+
+bool RandomSource::Refill() {
+    if (bulk) {
+        if (!seeded) {
+            // Lazily seed with a fresh key from the OS; nonce and counter start at zero.
+            uint8_t key[32];
+            if (!GetOSRandom(key, sizeof(key))) {
+                return false;
+            }
+            state[0] = 0x61707865;
+            state[1] = 0x3320646e;
+            state[2] = 0x79622d32;
+            state[3] = 0x6b206574;
+            for (int i = 0; i < 8; i++) {
+                state[4 + i] = ReadLE32(key + 4 * i);
+            }
+            memset(key, 0, sizeof(key));
+            seeded = true;
+        }
+        for (size_t i = 0; i < BUFFER_SIZE; i += 64) {
+            ChaCha20Block(state, &buf[i]);
+        }
+    } else if (!GetOSRandom(buf.data(), BUFFER_SIZE)) {
+        return false;
+    }
+    pos = 0;
+    return true;
+}
+
+bool RandomSource::GetBytes(uint8_t* out, size_t len) {
+    while (len > 0) {
+        if (pos == BUFFER_SIZE && !Refill()) {
+            fprintf(stderr, "Unable to read from RNG\n");
+            return false;
+        }
+        size_t n = std::min(len, BUFFER_SIZE - pos);
+        memcpy(out, &buf[pos], n);
+        memset(&buf[pos], 0, n);
+        pos += n;
+        out += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool RandomSource::GetBits(int bits, uint8_t& out) {
+    if (bitcount < bits) {
+        uint8_t b[3];
+        if (!GetBytes(b, 3)) {
+            return false;
+        }
+        bitbuf |= ((uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16)) << bitcount;
+        bitcount += 24;
+    }
+    out = bitbuf & ((1U << bits) - 1);
+    bitbuf >>= bits;
+    bitcount -= bits;
+    return true;
+}
+
+bool RandomSource::RandomInteger(const BigNum& range, BigNum& out) {
+    if (range.is_zero()) {
+        return false;
+    }
+    BigNum max = range;
+    max -= 1;
+    int bits = max.bits();
+    size_t len = (bits + 7) / 8;
+    scratch.resize(len);
+    uint8_t* data = scratch.data();
+    do {
+        // The low-order whole bytes come straight from the buffer; the top partial byte is
+        // drawn bit by bit, so a rejected attempt costs exactly bits random bits.
+        if (bits % 8) {
+            if (!GetBits(bits % 8, data[0]) || !GetBytes(data + 1, len - 1)) {
+                return false;
+            }
+        } else if (!GetBytes(data, len)) {
+            return false;
+        }
+        out = BigNum(data, len);
+    } while (out >= range);
+    return true;
+}
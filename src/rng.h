@@ -0,0 +1,44 @@
+#ifndef _GRAMTROPY_RNG_H_
+#define _GRAMTROPY_RNG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "bignum.h"
+
+/* Source of uniformly random integers.
+ *
+ * Bytes are drawn from the OS (getrandom, falling back to /dev/urandom) into
+ * a large buffer that is refilled as needed. In bulk mode, the OS is only used
+ * to seed a ChaCha20 keystream, which then provides all further randomness. */
+class RandomSource {
+    std::vector<uint8_t> buf;
+    size_t pos;
+
+    uint32_t bitbuf;
+    int bitcount;
+
+    bool bulk;
+    bool seeded;
+    uint32_t state[16];
+
+    std::vector<uint8_t> scratch;
+
+    bool Refill();
+
+public:
+    explicit RandomSource(bool bulk_ = false);
+    ~RandomSource();
+
+    bool GetBytes(uint8_t* out, size_t len);
+
+    /* Get bits (1-8) random bits. */
+    bool GetBits(int bits, uint8_t& out);
+
+    /* Produce a uniformly random number in [0, range). Rejection sampling only
+     * consumes as many bits as needed to represent range - 1. */
+    bool RandomInteger(const BigNum& range, BigNum& out);
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include "server.h"
+#include "rng.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+/* Longest request line accepted; a client sending more without a newline is disconnected. */
+static const size_t MAX_LINE = 1 << 20;
+
+/* Connections served at once. Further clients wait in the listen backlog. */
+static const int MAX_CONNECTIONS = 256;
+
+/* Counts the connections being served, so the accept loop can wait for a free one. */
+struct ConnectionLimit {
+    std::mutex mutex;
+    std::condition_variable freed;
+    int active;
+
+    ConnectionLimit() : active(0) {}
+
+    void Acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [&] { return active < MAX_CONNECTIONS; });
+        active++;
+    }
+
+    void Release() {
+        std::unique_lock<std::mutex> lock(mutex);
+        active--;
+        freed.notify_one();
+    }
+};
+
+const ServedGrammar* FindGrammar(const std::vector<ServedGrammar>& grammars, const char* name, size_t len) {
+    for (const auto& grammar : grammars) {
+        if (grammar.name.size() == len && memcmp(grammar.name.data(), name, len) == 0) {
+            return &grammar;
+        }
+    }
+    return nullptr;
+}
+
+void HandleRequest(const std::vector<ServedGrammar>& grammars, RandomSource& rng, const char* line, size_t len, std::string& out) {
+    if (len < 3 || line[1] != ' ') {
+        out += "ERR invalid request\n";
+        return;
+    }
+    const char* end = line + len;
+    const char* name = line + 2;
+    const char* sep = static_cast<const char*>(memchr(name, ' ', end - name));
+    const ServedGrammar* grammar = FindGrammar(grammars, name, (sep ? sep : end) - name);
+    if (!grammar) {
+        out += "ERR unknown grammar\n";
+        return;
+    }
+    const FlatGraph& graph = *grammar->graph;
+    uint32_t main = graph.root();
+    const char* arg = sep ? sep + 1 : end;
+
+    BigNum num;
+    switch (line[0]) {
+    case 'g':
+        if (!rng.RandomInteger(graph.Count(main), num)) {
+            out += "ERR unable to read from RNG\n";
+            return;
+        }
+        break;
+    case 'e':
+        if (arg == end || !num.set_hex(arg, end - arg)) {
+            out += "ERR cannot parse hex number\n";
+            return;
+        }
+        if (num.compare(graph.CountRef(main)) >= 0) {
+            out += "ERR number out of range (max " + graph.Count(main).hex() + ")\n";
+            return;
+        }
+        break;
+    case 'd':
+        if (!Parse(graph, main, arg, end - arg, num)) {
+            out += "ERR cannot decode phrase\n";
+            return;
+        }
+        out += "OK ";
+        out += num.hex();
+        out += '\n';
+        return;
+    default:
+        out += "ERR unknown command\n";
+        return;
+    }
+    out += "OK ";
+    Generate(graph, main, std::move(num), out);
+    out += '\n';
+}
+
+bool WriteAll(int fd, const std::string& data) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        ssize_t r = write(fd, data.data() + pos, data.size() - pos);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        pos += r;
+    }
+    return true;
+}
+
+void ServeConnection(int fd, const std::vector<ServedGrammar>& grammars, bool bulk, ConnectionLimit& limit) {
+    RandomSource rng(bulk);
+    std::string in, out;
+    std::vector<char> buf(65536);
+    size_t scanned = 0;
+    while (true) {
+        ssize_t r = read(fd, buf.data(), buf.size());
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        in.append(buf.data(), r);
+        // Answer every complete request in what was read, and send the responses at once.
+        size_t start = 0;
+        size_t nl;
+        while ((nl = in.find('\n', scanned)) != std::string::npos) {
+            size_t len = nl - start;
+            if (len > 0 && in[nl - 1] == '\r') {
+                len--;
+            }
+            HandleRequest(grammars, rng, in.data() + start, len, out);
+            start = scanned = nl + 1;
+        }
+        in.erase(0, start);
+        scanned = in.size();
+        bool toolong = in.size() > MAX_LINE;
+        if (toolong) {
+            out += "ERR request too long\n";
+        }
+        if (!WriteAll(fd, out) || toolong) {
+            break;
+        }
+        out.clear();
+    }
+    close(fd);
+    limit.Release();
+}
+
+/* Whether a server is accepting connections on addr. */
+bool InUse(const struct sockaddr_un& addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ret;
+}
+
+}
+
+bool RunServer(const char* path, const std::vector<ServedGrammar>& grammars, bool bulk) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long '%s'\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Clients going away must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+        return false;
+    }
+    // Replace a stale socket left by a previous instance, but never another kind of file, nor
+    // the socket of a server that is still running.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (InUse(addr)) {
+            fprintf(stderr, "Another server is listening on '%s'\n", path);
+            close(sock);
+            return false;
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0) {
+        fprintf(stderr, "Unable to listen on '%s': %s\n", path, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    // Connection threads may outlive this function's failure return, so the limit must too.
+    static ConnectionLimit limit;
+    while (true) {
+        limit.Acquire();
+        int fd = accept(sock, nullptr, nullptr);
+        if (fd < 0) {
+            limit.Release();
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+            close(sock);
+            return false;
+        }
+        std::thread(ServeConnection, fd, std::cref(grammars), bulk, std::ref(limit)).detach();
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef _GRAMTROPY_SERVER_H_
+#define _GRAMTROPY_SERVER_H_
+
+#include <string>
+#include <vector>
+
+#include "interpreter.h"
+
+/* Line-based protocol spoken over the Unix domain socket. Every request line gets exactly one
+ * response line, in order, so clients can pipeline any number of requests per connection.
+ *
+ *   g NAME          generate a random phrase
+ *   e NAME HEX      encode a hexadecimal number into a phrase
+ *   d NAME PHRASE   decode a phrase (everything after the single space) into hexadecimal
+ *
+ * Responses are "OK <result>" or "ERR <message>". NAME is the name a grammar was registered
+ * under (by gram, the translation file name without directory and extension).
+ *
+ * Request lines are limited to 1 MiB; a client exceeding that gets "ERR request too long" and
+ * is disconnected. At most 256 connections are served at once. */
+
+struct ServedGrammar {
+    std::string name;
+    const FlatGraph* graph;
+};
+
+/* Listen on path and serve requests until an error occurs; returns false then. Refuses to start
+ * if another server is accepting connections on path. */
+bool RunServer(const char* path, const std::vector<ServedGrammar>& grammars, bool bulk);
+
+#endif
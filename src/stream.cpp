@@ -0,0 +1,105 @@
+#include "stream.h"
+
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace {
+
+static const int CHUNKS_PER_THREAD = 4;
+
+struct Chunk {
+    std::string input;
+    std::string output;
+    std::string error;
+    int code;
+
+    Chunk() : code(0) {}
+};
+
+/* Read at least size bytes (or up to EOF) into chunk, ending at a line boundary. Bytes past
+ * the last newline are kept in carry for the next chunk. Returns false at end of input. */
+bool ReadChunk(FILE* in, size_t size, std::string& carry, std::string& chunk) {
+    chunk.swap(carry);
+    carry.clear();
+    size_t last = std::string::npos; // carry never contains a newline.
+    while (last == std::string::npos || chunk.size() < size) {
+        size_t pos = chunk.size();
+        chunk.resize(pos + size);
+        size_t r = fread(&chunk[pos], 1, size, in);
+        chunk.resize(pos + r);
+        if (r == 0) {
+            return !chunk.empty();
+        }
+        for (size_t i = pos + r; i > pos; i--) {
+            if (chunk[i - 1] == '\n') {
+                last = i - 1;
+                break;
+            }
+        }
+    }
+    carry.assign(chunk, last + 1, std::string::npos);
+    chunk.resize(last + 1);
+    return true;
+}
+
+void ProcessChunk(const LineHandler& handler, Chunk& chunk) {
+    chunk.output.clear();
+    chunk.code = 0;
+    const char* ptr = chunk.input.data();
+    const char* end = ptr + chunk.input.size();
+    while (ptr < end) {
+        const char* nl = static_cast<const char*>(memchr(ptr, '\n', end - ptr));
+        const char* lineend = nl ? nl : end;
+        chunk.code = handler(ptr, lineend - ptr, chunk.output, chunk.error);
+        if (chunk.code != 0 || !nl) {
+            return;
+        }
+        ptr = nl + 1;
+    }
+}
+
+}
+
+int ProcessLines(FILE* in, FILE* out, const LineHandler& handler, int threads, size_t chunksize) {
+    std::vector<Chunk> chunks(threads > 1 ? threads * CHUNKS_PER_THREAD : 1);
+    std::string carry;
+    bool more = true;
+    while (more) {
+        size_t num = 0;
+        while (num < chunks.size() && (more = ReadChunk(in, chunksize, carry, chunks[num].input))) {
+            num++;
+        }
+        if (threads > 1 && num > 1) {
+            std::atomic<size_t> next(0);
+            auto worker = [&]() {
+                size_t i;
+                while ((i = next++) < num) {
+                    ProcessChunk(handler, chunks[i]);
+                }
+            };
+            std::vector<std::thread> pool;
+            for (int i = 1; i < threads; i++) {
+                pool.emplace_back(worker);
+            }
+            worker();
+            for (auto& thread : pool) {
+                thread.join();
+            }
+        } else {
+            for (size_t i = 0; i < num; i++) {
+                ProcessChunk(handler, chunks[i]);
+            }
+        }
+        for (size_t i = 0; i < num; i++) {
+            fwrite(chunks[i].output.data(), 1, chunks[i].output.size(), out);
+            if (chunks[i].code != 0) {
+                fflush(out);
+                fputs(chunks[i].error.c_str(), stderr);
+                return chunks[i].code;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _GRAMTROPY_STREAM_H_
+#define _GRAMTROPY_STREAM_H_
+
+#include <stdio.h>
+#include <functional>
+#include <string>
+
+/* Handles one input line (without its newline), appending its output to out. Returns 0 on
+ * success, or an exit code after putting an error message in err. Must be thread-safe when
+ * used with multiple threads. */
+typedef std::function<int(const char* line, size_t len, std::string& out, std::string& err)> LineHandler;
+
+static const size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+/* Run handler on every line of in, of any length, and write the outputs to out in input order.
+ * Input is read in chunks of at least chunksize bytes of whole lines; with threads > 1 those are
+ * processed in parallel, so handlers that are slow per byte should use smaller chunks.
+ * On the first failing line, the output of all earlier lines is written, the error is printed,
+ * and its exit code is returned. Returns 0 otherwise. */
+int ProcessLines(FILE* in, FILE* out, const LineHandler& handler, int threads, size_t chunksize = DEFAULT_CHUNK_SIZE);
+
+#endif
@@ -4,15 +4,74 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <stdint.h>
 #include <string.h>
 
+#include "flatarray.h"
+#include "perfecthash.h"
+
+/* A sorted list of strings that all have the same length, stored back to back.
+ *
+ * For lookups, the first 8 bytes of every string are also kept as big-endian integers (padded
+ * with zeroes), which compare like the strings do. find does its binary search on those, and
+ * only compares the remaining bytes of strings longer than 8 bytes whose first 8 match. If the
+ * translation file has perfect hash seeds for the list (see perfecthash.h), find instead hashes
+ * str, and compares it with the one string in its slot.
+ *
+ * The strings and these indexes can also live in externally owned memory, such as a mapped image
+ * file (see image.h), in which case nothing is copied or computed. */
 class Strings {
+    // What find uses comes first, to keep it together.
     size_t len;
     size_t count;
-    std::vector<char> buf;
+    const char* buf;
+    FlatArray<uint64_t> prefixes;
+    FlatArray<uint32_t> slots; // For each perfect hash slot, the index of the string in it.
+    FlatArray<uint32_t> seeds; // Perfect hash seed per bucket, if any.
+    std::vector<char> storage;
+
+    static uint64_t Prefix(const char* str, size_t len_) {
+        uint64_t ret = 0;
+        if (len_ >= 8) {
+            for (size_t i = 0; i < 8; i++) {
+                ret = (ret << 8) | (unsigned char)str[i];
+            }
+            return ret;
+        }
+        for (size_t i = 0; i < 8; i++) {
+            ret = (ret << 8) | (i < len_ ? (unsigned char)str[i] : 0);
+        }
+        return ret;
+    }
+
+    void Index() {
+        std::vector<uint64_t> prefixes_(count);
+        for (size_t i = 0; i < count; i++) {
+            prefixes_[i] = Prefix(StringBegin(i), len);
+        }
+        prefixes = FlatArray<uint64_t>(std::move(prefixes_));
+    }
 
 public:
-    Strings(std::vector<char>&& data, size_t len_) : len(len_), count(data.size() / len_), buf(std::move(data)) {}
+    Strings(std::vector<char>&& data, size_t len_) : len(len_), count(data.size() / len_), storage(std::move(data)) {
+        buf = storage.data();
+        Index();
+    }
+
+    /* Refer to count strings of length len_ in externally owned memory, with their prefixes and,
+     * unless slots_ is null, the perfect hash slots and PerfectHashBuckets(count) seeds, as
+     * returned by Prefixes, Slots and Seeds. Nothing is copied or checked; every slot must be
+     * below count. */
+    Strings(const char* data, size_t len_, size_t count_, const uint64_t* prefixes_, const uint32_t* slots_, const uint32_t* seeds_) : len(len_), count(count_), buf(data), prefixes(prefixes_, count_) {
+        if (slots_) {
+            slots = FlatArray<uint32_t>(slots_, count_);
+            seeds = FlatArray<uint32_t>(seeds_, PerfectHashBuckets(count_));
+        }
+    }
+
+    Strings(Strings&&) = default;
+    Strings(const Strings&) = delete;
+    Strings& operator=(const Strings&) = delete;
 
     size_t size() const {
         return count;
@@ -22,30 +81,81 @@ public:
         return count == 0;
     }
 
-    std::vector<char>::const_iterator StringBegin(size_t num) const {
-        return buf.begin() + num * len;
+    size_t length() const {
+        return len;
     }
 
-    std::vector<char>::const_iterator StringEnd(size_t num) const {
-        if ((num + 1) * len == buf.size()) {
-            return buf.end();
-        }
-        return buf.begin() + (num + 1) * len;
+    const char* StringBegin(size_t num) const {
+        return buf + num * len;
+    }
+
+    const char* StringEnd(size_t num) const {
+        return buf + (num + 1) * len;
     }
 
     std::string operator[](size_t num) const {
         return std::string(StringBegin(num), StringEnd(num));
     }
 
+    /* Use the given perfect hash seeds for lookups. Returns false, and keeps using binary search,
+     * if they do not map the strings to distinct slots. */
+    bool SetPerfectHash(std::vector<uint32_t>&& seeds_) {
+        if (seeds_.size() != PerfectHashBuckets(count)) {
+            return false;
+        }
+        std::vector<uint32_t> slots_(count, (uint32_t)-1);
+        for (size_t i = 0; i < count; i++) {
+            uint64_t hash = PerfectHashWord(StringBegin(i), len);
+            uint32_t slot = PerfectHashSlot(hash, seeds_[PerfectHashBucket(hash, seeds_.size())], count);
+            if (slots_[slot] != (uint32_t)-1) {
+                return false;
+            }
+            slots_[slot] = i;
+        }
+        seeds = FlatArray<uint32_t>(std::move(seeds_));
+        slots = FlatArray<uint32_t>(std::move(slots_));
+        return true;
+    }
+
+    bool HasPerfectHash() const {
+        return !slots.empty();
+    }
+
+    /* The lookup indexes, for storing them with the strings. Slots and Seeds are empty without a
+     * perfect hash. */
+    const FlatArray<uint64_t>& Prefixes() const {
+        return prefixes;
+    }
+
+    const FlatArray<uint32_t>& Slots() const {
+        return slots;
+    }
+
+    const FlatArray<uint32_t>& Seeds() const {
+        return seeds;
+    }
+
+    /* Return the index of str, or -1 if it is not in the list. */
     int find(const char* str, size_t len_) const {
         if (len != len_) {
             return -1;
         }
+        if (!slots.empty()) {
+            uint64_t hash = PerfectHashWord(str, len);
+            uint32_t index = slots[PerfectHashSlot(hash, seeds[PerfectHashBucket(hash, PerfectHashBuckets(count))], count)];
+            return memcmp(str, StringBegin(index), len) == 0 ? (int)index : -1;
+        }
+        uint64_t key = Prefix(str, len);
         int first = 0;
         int after = count;
-        do {
+        while (after > first) {
             int mid = (first + after) >> 1;
-            int r = memcmp(str, &*StringBegin(mid), len_);
+            int r = 0;
+            if (prefixes[mid] != key) {
+                r = prefixes[mid] < key ? 1 : -1;
+            } else if (len > 8) {
+                r = memcmp(str + 8, StringBegin(mid) + 8, len - 8);
+            }
             if (r == 0) {
                 return mid;
             } else if (r < 0) {
@@ -53,7 +163,28 @@ public:
             } else {
                 first = mid + 1;
             }
-        } while (after > first);
+        }
+        return -1;
+    }
+
+    /* The plain binary search over whole strings, kept as a reference for benchmarks. */
+    int find_bsearch(const char* str, size_t len_) const {
+        if (len != len_) {
+            return -1;
+        }
+        int first = 0;
+        int after = count;
+        while (after > first) {
+            int mid = (first + after) >> 1;
+            int r = memcmp(str, StringBegin(mid), len);
+            if (r == 0) {
+                return mid;
+            } else if (r < 0) {
+                after = mid;
+            } else {
+                first = mid + 1;
+            }
+        }
         return -1;
     }
 };
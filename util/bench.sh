@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compile every grammar in grammars/ at each of the given security levels (default: 32 64 128
+# 256 bits), and measure the compiler and the interpreter on the result. Prints one line per
+# measurement, as "grammar bits metric value unit". Run from the repository root, after
+# building gramc and grambench (make bench does both).
+
+BITS=${*:-32 64 128 256}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo "# grammar bits metric value unit"
+for gram in grammars/*.gram; do
+    name=$(basename "$gram" .gram)
+    for bits in $BITS; do
+        if ! ./gramc -b "$bits" -P "$TMP/profile.json" "$gram" "$TMP/out.gtp" > /dev/null 2> "$TMP/error"; then
+            echo "$name $bits failed $(head -n 1 "$TMP/error" | tr ' ' '_') -"
+            continue
+        fi
+        # Compiler time is the sum of its stages; the expansions are listed separately.
+        awk -v prefix="$name $bits" '
+            /"name":/ { sub(/.*"seconds": /, ""); sub(/}.*/, ""); total += $0 }
+            /"peak_rss_kb":/ { gsub(/[^0-9]/, ""); rss = $0 }
+            END { printf "%s gramc_time %.3f s\n%s gramc_peak_rss %d kB\n", prefix, total, prefix, rss }
+        ' "$TMP/profile.json"
+        ./grambench -r "$TMP/out.gtp" | awk -v prefix="$name $bits" '{ print prefix, $2, $3, $4 }'
+    done
+done
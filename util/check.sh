@@ -0,0 +1,44 @@
+#!/bin/sh
+# Check that the output of gramc does not depend on how it was produced. Every grammar in
+# grammars/ is compiled at each of the given security levels (default: 32 64 bits) without a
+# cache, and then twice with a cache shared by all levels of that grammar: once filling it (with
+# whatever the lower levels left in it) and once reusing it. All must give the same translation
+# file, as must compiling with 4 threads. Then each entry of util/golden.txt is compiled and compared with its recorded checksum.
+# Prints one line per failure, and exits with status 1 if there was any. Run from the
+# repository root, after building gramc (make check does both).
+
+BITS=${*:-32 64}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+fail() {
+    echo "$1"
+    FAILED=1
+}
+
+for gram in grammars/*.gram; do
+    name=$(basename "$gram" .gram)
+    for bits in $BITS; do
+        if ! ./gramc -b "$bits" "$gram" "$TMP/plain.gtp" > /dev/null 2>&1; then
+            echo "$name $bits skipped (does not compile)"
+            continue
+        fi
+        ./gramc -b "$bits" -C "$TMP/$name.cache" "$gram" "$TMP/cold.gtp" > /dev/null 2>&1
+        cmp -s "$TMP/plain.gtp" "$TMP/cold.gtp" || fail "$name $bits differs when filling the cache"
+        ./gramc -b "$bits" -C "$TMP/$name.cache" "$gram" "$TMP/warm.gtp" > /dev/null 2>&1
+        cmp -s "$TMP/plain.gtp" "$TMP/warm.gtp" || fail "$name $bits differs when reusing the cache"
+        ./gramc -b "$bits" -j 4 "$gram" "$TMP/threads.gtp" > /dev/null 2>&1
+        cmp -s "$TMP/plain.gtp" "$TMP/threads.gtp" || fail "$name $bits differs with 4 threads"
+    done
+done
+
+grep -v '^#' util/golden.txt | while read -r name bits sum; do
+    rm -f "$TMP/golden.gtp"
+    ./gramc -b "$bits" "grammars/$name.gram" "$TMP/golden.gtp" > /dev/null 2>&1
+    if [ "$(sha256sum < "$TMP/golden.gtp" | cut -d ' ' -f 1)" != "$sum" ]; then
+        echo "$name $bits does not match util/golden.txt"
+    fi
+done | grep . && FAILED=1
+
+exit $FAILED